@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "harness.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME           "protect_exec_bench_mounts_cgroup"
+#define BASE_PATH             "/tmp/protect_exec_bench_mounts"
+#define PROBE_PATH            (BASE_PATH "/probe")
+#define EXEC_PATH             "/idle"
+#define DEFAULT_MAX_SANDBOXES 64
+#define DEFAULT_ROUNDS        200
+
+static int open_sandbox(struct protect_exec_session **sessions, long index, struct protect_exec_opts *opts);
+static int measure(long sandboxes, long rounds, double *mount_us, double *umount_us);
+static void usage(void);
+
+// Description:
+//   Measure how long mounting and unmounting a tmpfs takes on the host while
+//   0, 1, 2, 4, ... MAX_SANDBOXES sandboxes are alive. Sandboxes are kept
+//   open as sessions below a shared mount, which stands in for a host whose
+//   mounts are shared, as under systemd. Mount events on the host must not
+//   fan out into the sandbox namespaces, so latency should stay flat.
+int main(int argc, char **argv)
+{
+	struct harness_cgroup cgroup;
+	struct protect_exec_session **sessions = NULL;
+	double *mount_us = NULL;
+	double *umount_us = NULL;
+	long opened = 0;
+	int ret = 1;
+
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	if(harness_chdir_exec())
+	{
+		log_err("Benchmark failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	long max_sandboxes = argc > 2 ? atol(argv[2]) : DEFAULT_MAX_SANDBOXES;
+	long rounds = argc > 3 ? atol(argv[3]) : DEFAULT_ROUNDS;
+
+	if(max_sandboxes < 0 || rounds < 1)
+	{
+		usage();
+		goto error_0;
+	}
+
+	if(harness_cgroup_open(&cgroup, argc > 4 ? argv[4] : NULL, CGROUP_NAME, "cpu", NULL))
+	{
+		log_err("Benchmark failed. Could not set up a cgroup.");
+		goto error_0;
+	}
+
+	if(mkdir(BASE_PATH, 0755))
+	{
+		log_err("Benchmark failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", BASE_PATH);
+		goto error_1;
+	}
+
+	if(mount("tmpfs", BASE_PATH, "tmpfs", 0, NULL) || mount(NULL, BASE_PATH, NULL, MS_SHARED, NULL))
+	{
+		log_err("Benchmark failed. Could not mount a shared tmpfs at \"%s\".", BASE_PATH);
+		umount2(BASE_PATH, MNT_DETACH);
+		goto error_2;
+	}
+
+	if(mkdir(PROBE_PATH, 0755))
+	{
+		log_err("Benchmark failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", PROBE_PATH);
+		goto error_3;
+	}
+
+	sessions = calloc(max_sandboxes + 1, sizeof(*sessions));
+	mount_us = calloc(rounds, sizeof(double));
+	umount_us = calloc(rounds, sizeof(double));
+
+	if(sessions == NULL || mount_us == NULL || umount_us == NULL)
+	{
+		log_err("Benchmark failed. Out of memory.");
+		goto error_4;
+	}
+
+	char fs_path[PATH_MAX];
+	harness_image_path(fs_path, sizeof(fs_path));
+
+	struct protect_exec_opts opts;
+	protect_exec_opts_init(&opts);
+	opts.uid = (uid_t) atoi(argv[1]);
+	opts.fs_path = fs_path;
+	opts.cgroup_path = cgroup.path;
+
+	printf("%9s %14s %14s %14s %14s\n", "sandboxes", "mount_p50_us", "mount_p99_us", "umount_p50_us", "umount_p99_us");
+
+	for(long level = 0;; level = level ? level * 2 : 1)
+	{
+		if(level > max_sandboxes)
+		{
+			level = max_sandboxes;
+		}
+
+		for(; opened < level; opened++)
+		{
+			if(open_sandbox(sessions, opened, &opts))
+			{
+				log_err("Benchmark failed. Could not open sandbox %ld.", opened);
+				goto error_5;
+			}
+		}
+
+		if(measure(opened, rounds, mount_us, umount_us))
+		{
+			goto error_5;
+		}
+
+		qsort(mount_us, rounds, sizeof(double), harness_compare_double);
+		qsort(umount_us, rounds, sizeof(double), harness_compare_double);
+
+		printf("%9ld %14.1f %14.1f %14.1f %14.1f\n", opened,
+			mount_us[rounds / 2], mount_us[(rounds * 99) / 100],
+			umount_us[rounds / 2], umount_us[(rounds * 99) / 100]);
+
+		if(level == max_sandboxes)
+		{
+			break;
+		}
+	}
+
+	ret = 0;
+
+error_5:
+	for(long i = 0; i < opened; i++)
+	{
+		protect_exec_session_close(sessions[i]);
+	}
+
+	protect_exec_drain();
+
+	for(long i = 0; i < opened; i++)
+	{
+		char mnt_path[PATH_MAX];
+		snprintf(mnt_path, sizeof(mnt_path), "%s/sandbox_%ld", BASE_PATH, i);
+		rmdir(mnt_path);
+	}
+error_4:
+	free(sessions);
+	free(mount_us);
+	free(umount_us);
+	rmdir(PROBE_PATH);
+error_3:
+	if(umount2(BASE_PATH, MNT_DETACH))
+	{
+		log_err("umount2(2) failed.");
+		log_err("umount2(\"%s\", MNT_DETACH)", BASE_PATH);
+	}
+error_2:
+	if(rmdir(BASE_PATH))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", BASE_PATH);
+	}
+error_1:
+	harness_cgroup_close(&cgroup);
+error_0:
+	return ret;
+}
+
+// Description:
+//   Open a session on a mount path of its own below BASE_PATH and run one
+//   command in it, so that it is known to be fully set up.
+// Returns:
+//   0 on success, -1 on failure.
+static int open_sandbox(struct protect_exec_session **sessions, long index, struct protect_exec_opts *opts)
+{
+	char *const exec_argv[] = { EXEC_PATH, NULL };
+	char *const exec_envp[] = { NULL };
+	char mnt_path[PATH_MAX];
+	struct protect_exec_result result;
+
+	snprintf(mnt_path, sizeof(mnt_path), "%s/sandbox_%ld", BASE_PATH, index);
+
+	if(mkdir(mnt_path, 0755))
+	{
+		return -1;
+	}
+
+	opts->mnt_path = mnt_path;
+	sessions[index] = protect_exec_session_open(opts);
+
+	if(sessions[index] == NULL)
+	{
+		rmdir(mnt_path);
+		return -1;
+	}
+
+	opts->exec_path = EXEC_PATH;
+	opts->argv = exec_argv;
+	opts->envp = exec_envp;
+
+	if(protect_exec_session_run(sessions[index], opts, &result) || !WIFEXITED(result.status) || WEXITSTATUS(result.status))
+	{
+		protect_exec_session_close(sessions[index]);
+		rmdir(mnt_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Mount and unmount a tmpfs at PROBE_PATH 'rounds' times, timing each.
+// Returns:
+//   0 on success, -1 on failure.
+static int measure(long sandboxes, long rounds, double *mount_us, double *umount_us)
+{
+	for(long i = 0; i < rounds; i++)
+	{
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if(mount("tmpfs", PROBE_PATH, "tmpfs", 0, NULL))
+		{
+			log_err("Benchmark failed. mount(2) failed. (sandboxes: %ld)", sandboxes);
+			log_err("mount(\"tmpfs\", \"%s\", \"tmpfs\", 0, NULL)", PROBE_PATH);
+			return -1;
+		}
+
+		mount_us[i] = harness_elapsed_ms(&start) * 1e3;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if(umount2(PROBE_PATH, 0))
+		{
+			log_err("Benchmark failed. umount2(2) failed. (sandboxes: %ld)", sandboxes);
+			log_err("umount2(\"%s\", 0)", PROBE_PATH);
+			return -1;
+		}
+
+		umount_us[i] = harness_elapsed_ms(&start) * 1e3;
+	}
+
+	return 0;
+}
+
+static void usage(void)
+{
+	puts("USAGE: bench_mounts UID [MAX_SANDBOXES [ROUNDS [CGROUP_PATH]]]");
+}
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "harness.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME       "protect_exec_bench_placement_cgroup"
+#define EXEC_PATH         "/memory_bound"
+#define ROOT_MNT_PREFIX   "/tmp/protect_exec_bench_placement_mnt"
+#define DEFAULT_LAUNCHES  20
+#define PAYLOAD_MEGABYTES "256"
+#define PAYLOAD_PASSES    "8"
+
+enum mode {
+	MODE_FLOAT,
+	MODE_AUTO,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = { "float", "auto" };
+
+// One concurrent launcher, with its own mount path. Every worker launches
+// into the same cgroup; each placed sandbox gets a leaf cgroup below it.
+struct worker {
+	pthread_t thread;
+	enum mode mode;
+	long launches;
+	char mnt_path[PATH_MAX];
+	const char *cgroup_path;
+	const char *fs_path;
+	uid_t uid;
+	double *latencies;
+	long failures;
+};
+
+static char root_cpus[4096];
+static char root_mems[4096];
+
+static void *worker_run(void *data);
+static int read_list(const char *cgroup_path, const char *name, char *list, size_t size);
+static void usage(void);
+
+// Description:
+//   Compare launch latency of a memory-bound payload when sandboxes float
+//   across every CPU and memory node ("float") against automatic
+//   least-loaded, node-local placement ("auto"). WORKERS sandboxes run
+//   concurrently, each launching LAUNCHES times per mode.
+int main(int argc, char **argv)
+{
+	struct harness_cgroup cgroup;
+	struct worker *workers = NULL;
+	int ret = 1;
+
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	if(harness_chdir_exec())
+	{
+		log_err("Benchmark failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	long launches = argc > 2 ? atol(argv[2]) : DEFAULT_LAUNCHES;
+	long worker_count = argc > 3 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(launches < 1 || worker_count < 1)
+	{
+		usage();
+		goto error_0;
+	}
+
+	// The cgroup must belong to a cpuset hierarchy. Mount one unless given.
+	if(harness_cgroup_open(&cgroup, argc > 4 ? argv[4] : NULL, CGROUP_NAME, "cpuset", NULL))
+	{
+		log_err("Benchmark failed. Could not set up a cgroup.");
+		goto error_0;
+	}
+
+	const char *cgroup_path = cgroup.path;
+
+	// "float" confines each sandbox to everything its parent cgroup allows
+	if(read_list(cgroup_path, "cpuset.cpus", root_cpus, sizeof(root_cpus)) ||
+	   read_list(cgroup_path, "cpuset.mems", root_mems, sizeof(root_mems)))
+	{
+		log_err("Benchmark failed. \"%s\" is not a cpuset cgroup.", cgroup_path);
+		goto error_1;
+	}
+
+	char fs_path[PATH_MAX];
+	harness_image_path(fs_path, sizeof(fs_path));
+
+	workers = calloc(worker_count, sizeof(*workers));
+
+	if(workers == NULL)
+	{
+		log_err("Benchmark failed. Out of memory.");
+		goto error_1;
+	}
+
+	long created = 0;
+
+	for(; created < worker_count; created++)
+	{
+		struct worker *worker = &workers[created];
+
+		worker->launches = launches;
+		worker->fs_path = fs_path;
+		worker->uid = (uid_t) atoi(argv[1]);
+		snprintf(worker->mnt_path, sizeof(worker->mnt_path), "%s_%ld", ROOT_MNT_PREFIX, created);
+		worker->cgroup_path = cgroup_path;
+		worker->latencies = calloc(launches, sizeof(double));
+
+		if(worker->latencies == NULL || mkdir(worker->mnt_path, 0755))
+		{
+			log_err("Benchmark failed. Could not set up worker %ld.", created);
+			free(worker->latencies);
+			goto error_2;
+		}
+	}
+
+	printf("%-6s %8s %8s %10s %10s %10s %10s\n", "mode", "launches", "failures", "mean_ms", "p50_ms", "p99_ms", "max_ms");
+
+	for(int mode = 0; mode < MODE_COUNT; mode++)
+	{
+		long total = worker_count * launches;
+		long failures = 0;
+		double *latencies = malloc(total * sizeof(double));
+
+		if(latencies == NULL)
+		{
+			log_err("Benchmark failed. Out of memory.");
+			goto error_2;
+		}
+
+		for(long i = 0; i < worker_count; i++)
+		{
+			workers[i].mode = mode;
+			workers[i].failures = 0;
+			pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+		}
+
+		for(long i = 0; i < worker_count; i++)
+		{
+			pthread_join(workers[i].thread, NULL);
+			memcpy(latencies + i * launches, workers[i].latencies, launches * sizeof(double));
+			failures += workers[i].failures;
+		}
+
+		qsort(latencies, total, sizeof(double), harness_compare_double);
+
+		double sum = 0;
+
+		for(long i = 0; i < total; i++)
+		{
+			sum += latencies[i];
+		}
+
+		printf("%-6s %8ld %8ld %10.1f %10.1f %10.1f %10.1f\n", mode_names[mode], total, failures,
+			sum / total, latencies[total / 2], latencies[(total * 99) / 100], latencies[total - 1]);
+
+		free(latencies);
+	}
+
+	ret = 0;
+
+error_2:
+	protect_exec_drain();
+
+	for(long i = 0; i < created; i++)
+	{
+		rmdir(workers[i].mnt_path);
+		free(workers[i].latencies);
+	}
+
+	free(workers);
+error_1:
+	harness_cgroup_close(&cgroup);
+error_0:
+	return ret;
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *worker = data;
+	char *const exec_argv[] = { EXEC_PATH, PAYLOAD_MEGABYTES, PAYLOAD_PASSES, NULL };
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_opts opts;
+
+	protect_exec_opts_init(&opts);
+	opts.uid = worker->uid;
+	opts.fs_path = worker->fs_path;
+	opts.mnt_path = worker->mnt_path;
+	opts.cgroup_path = worker->cgroup_path;
+	opts.exec_path = EXEC_PATH;
+	opts.argv = exec_argv;
+	opts.envp = exec_envp;
+
+	if(worker->mode == MODE_FLOAT)
+	{
+		opts.cpus = root_cpus;
+		opts.mems = root_mems;
+	}
+	else
+	{
+		opts.auto_cpus = 1;
+	}
+
+	for(long i = 0; i < worker->launches; i++)
+	{
+		struct protect_exec_result result;
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if(protect_exec_ex(&opts, &result) || !WIFEXITED(result.status) || WEXITSTATUS(result.status))
+		{
+			worker->failures++;
+		}
+
+		worker->latencies[i] = harness_elapsed_ms(&start);
+
+		// The next launch reuses mnt_path. Drain outside the measured time,
+		// so that latencies do not include waiting for this teardown.
+		protect_exec_drain();
+	}
+
+	return NULL;
+}
+
+// Description:
+//   Read a cpuset list file of a cgroup, without its trailing newline.
+// Returns:
+//   0 on success, -1 on failure.
+static int read_list(const char *cgroup_path, const char *name, char *list, size_t size)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", cgroup_path, name);
+
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL)
+	{
+		return -1;
+	}
+
+	if(fgets(list, size, file) == NULL)
+	{
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	list[strcspn(list, "\n")] = 0;
+
+	return list[0] ? 0 : -1;
+}
+
+static void usage(void)
+{
+	puts("USAGE: bench_placement UID [LAUNCHES [WORKERS [CGROUP_PATH]]]");
+}
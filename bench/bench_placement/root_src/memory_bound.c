@@ -0,0 +1,32 @@
+#include <stdlib.h>
+
+// Memory-bound payload: touch a buffer larger than the last-level cache, then
+// walk it with a cache-line stride. Usage: memory_bound [MEGABYTES [PASSES]]
+int main(int argc, char **argv)
+{
+	size_t size = (size_t) (argc > 1 ? atoi(argv[1]) : 256) << 20;
+	int passes = argc > 2 ? atoi(argv[2]) : 8;
+	volatile unsigned char *buf = malloc(size);
+	unsigned long sum = 0;
+
+	if(buf == NULL)
+	{
+		return 1;
+	}
+
+	for(size_t i = 0; i < size; i += 64)
+	{
+		buf[i] = (unsigned char) i;
+	}
+
+	for(int pass = 0; pass < passes; pass++)
+	{
+		// Stride by a prime number of cache lines to defeat the prefetcher
+		for(size_t i = 0, j = 0; i < size; i += 64, j = (j + 64 * 97) % size)
+		{
+			sum += buf[j];
+		}
+	}
+
+	return sum == 1;
+}
@@ -0,0 +1,10 @@
+#ifndef _PROTECT_EXEC_CGROUP_H
+#define _PROTECT_EXEC_CGROUP_H
+
+#include <stddef.h>
+
+extern int cgroup_leaf_create(const char *cgroup_path, char *leaf_path,
+                              size_t size);
+extern void cgroup_leaf_remove(const char *leaf_path);
+
+#endif
@@ -10,7 +10,51 @@
 // Namespaces for clone process to detach from
 #define CLONE_NAMESPACES (CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWNET)
 
+// Attributes set on the sandbox root and every mount below it before the
+// program runs (MOUNT_ATTR_* of mount_setattr(2)). Drop MOUNT_ATTR_RDONLY to
+// keep writable '/etc/fstab' entries such as tmpfs writable.
+// Default: MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV
+#define SANDBOX_MOUNT_ATTR (MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV)
+
 // Path of directory to check for loopback device files
 #define LOOPBACK_DEV_DIR "/dev/loop"
 
+// Name prefix of the cgroup created below 'cgroup_path' for a single launch
+// that is placed or time-limited, followed by the PID of the launcher and a
+// sequence number
+// Default: "pexec"
+#define CGROUP_LEAF_PREFIX "pexec"
+
+// Hand unmounting and loopback device release to a background thread instead
+// of performing them before protect_exec(3) returns. Callers that reuse or
+// remove a mount path must call protect_exec_drain(3) first.
+// Default: 1
+#define DEFERRED_TEARDOWN 1
+
+// Shortest interval between two reads of a sandbox cgroup's CPU usage while
+// enforcing a CPU time limit. Reads are spaced further apart while the limit
+// is far away.
+// Default: 10ms
+#define DEADLINE_CPU_POLL_MS 10
+
+// Publish launch counters, gauges and latency histograms to a POSIX
+// shared-memory segment shared by every process linking libpexec. Read it
+// with pexec_metrics(8).
+// Default: 1
+#define METRICS 1
+
+// Name of the metrics segment passed to shm_open(3)
+#define METRICS_SHM_NAME "/pexec_metrics"
+
+// Default path of the Unix socket on which pexecd(8) accepts launch requests
+#define PEXECD_SOCKET_PATH "/run/pexecd.sock"
+
+// Most UIDs that may be allowed with pexecd(8) -u
+#define PEXECD_MAX_ALLOWED_UIDS 64
+
+// Largest launch request (paths, argv and envp) accepted over the pexecd(8)
+// socket.
+// Default: 64KB
+#define PEXEC_PROTO_MAX_MSG (1<<16)
+
 #endif
@@ -0,0 +1,30 @@
+#ifndef _PROTECT_EXEC_DEADLINE_H
+#define _PROTECT_EXEC_DEADLINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protect_exec.h"
+
+// Time limits of a single launch and the descriptors used to enforce them.
+// 'pidfd' is filled in by clone(2) with CLONE_PIDFD.
+struct deadline {
+	bool armed;
+	int pidfd;
+	int kill_fd;
+	int usage_fd;
+	bool usage_ns;
+	uint64_t usage_base_us;
+	long cpu_count;
+	unsigned int wall_timeout_ms;
+	unsigned int cpu_timeout_ms;
+};
+
+extern int deadline_prepare(const struct protect_exec_opts *opts,
+                            const char *cgroup_path,
+                            struct deadline *deadline);
+extern int deadline_apply_rlimit(const struct deadline *deadline);
+extern int deadline_wait(struct deadline *deadline, pid_t pid, int *exceeded);
+extern void deadline_release(struct deadline *deadline);
+
+#endif
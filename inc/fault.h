@@ -0,0 +1,17 @@
+#ifndef _PROTECT_EXEC_FAULT_H
+#define _PROTECT_EXEC_FAULT_H
+
+#include <errno.h>
+
+// Failure injection for leak and soak testing. When built with
+// -DPROTECT_EXEC_FAULT_INJECTION, setting 'protect_exec_fault_step' to one of
+// the numbered steps of protect_exec(3) (1 through 8) makes that step fail
+// with EIO, exercising its error path. 0 disables injection.
+#ifdef PROTECT_EXEC_FAULT_INJECTION
+extern int protect_exec_fault_step;
+#define fault_inject(step) ((step) == protect_exec_fault_step ? (errno = EIO, 1) : 0)
+#else
+#define fault_inject(step) 0
+#endif
+
+#endif
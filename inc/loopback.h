@@ -1,6 +1,7 @@
 #ifndef _PROTECT_EXEC_LOOPBACK_H
 #define _PROTECT_EXEC_LOOPBACK_H
 
-extern char *loopback_setup(const char *filename);
+extern char *loopback_setup(const char *filename, int *loop_fd);
+extern void loopback_release(int loop_fd);
 
 #endif
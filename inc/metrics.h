@@ -0,0 +1,65 @@
+#ifndef _PROTECT_EXEC_METRICS_H
+#define _PROTECT_EXEC_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_MAGIC   0x70786d73
+#define METRICS_VERSION 1
+
+// Failures are counted by the numbered step of protect_exec(3) at which they
+// happened, 0 (input validation and placement) through 8 (execve(2)).
+#define METRICS_STEPS 9
+
+// Upper bounds of the latency histogram buckets, in microseconds. The last
+// bucket is unbounded.
+#define METRICS_LATENCY_BUCKETS 16
+#define METRICS_LATENCY_BOUNDS_US { \
+	250, 500, 1000, 2500, 5000, 10000, 25000, 50000, \
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, UINT64_MAX }
+
+#define METRICS_CACHE_LINE 64
+
+struct metrics_histogram {
+	uint64_t counts[METRICS_LATENCY_BUCKETS];
+	uint64_t sum_us;
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+// Layout of the shared-memory segment METRICS_SHM_NAME. Every process
+// linking libpexec adds to the same counters with relaxed atomic operations;
+// readers load them the same way and never take a lock. Groups updated on
+// every launch sit on cache lines of their own.
+struct metrics_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t bounds_us[METRICS_LATENCY_BUCKETS];
+
+	// Launches started, and failed by step
+	uint64_t launches __attribute__((aligned(METRICS_CACHE_LINE)));
+	uint64_t failures[METRICS_STEPS];
+
+	// Sandboxes killed for exceeding a limit, by PROTECT_EXEC_DEADLINE_*
+	uint64_t deadlines_exceeded[3];
+
+	// Gauges
+	int64_t sandboxes_active __attribute__((aligned(METRICS_CACHE_LINE)));
+	int64_t loops_in_use __attribute__((aligned(METRICS_CACHE_LINE)));
+
+	// Time from the start of a launch until the sandbox child calls
+	// execve(2) or a session stub is ready, recorded only for launches that
+	// get that far, and from the end of a launch until its mount and
+	// loopback device are gone
+	struct metrics_histogram setup_latency;
+	struct metrics_histogram teardown_latency;
+};
+
+extern void metrics_count_launch(void);
+extern void metrics_count_failure(int step);
+extern void metrics_count_deadline(int deadline);
+extern void metrics_add_sandboxes(int delta);
+extern void metrics_add_loops(int delta);
+extern void metrics_observe_setup(const struct timespec *start);
+extern void metrics_observe_teardown(const struct timespec *start);
+
+#endif
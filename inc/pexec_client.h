@@ -0,0 +1,11 @@
+#ifndef _PROTECT_EXEC_CLIENT_H
+#define _PROTECT_EXEC_CLIENT_H
+
+#include "protect_exec.h"
+
+extern int pexec_client_launch(const char *socket_path,
+                               const struct protect_exec_opts *opts,
+                               int cgroup_fd,
+                               struct protect_exec_result *result);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _PROTECT_EXEC_PLACEMENT_H
+#define _PROTECT_EXEC_PLACEMENT_H
+
+#include <sched.h>
+#include <stdbool.h>
+
+#include "protect_exec.h"
+
+// Longest CPU or memory node list written to a cpuset file
+#define PLACEMENT_LIST_MAX 4096
+
+// CPU and memory node placement resolved for a single launch.
+struct placement {
+	bool cpus_set;
+	bool mems_set;
+	bool claimed;
+	cpu_set_t cpus;
+	char cpus_list[PLACEMENT_LIST_MAX];
+	char mems_list[PLACEMENT_LIST_MAX];
+};
+
+extern int placement_resolve(const struct protect_exec_opts *opts,
+                             struct placement *placement);
+extern int placement_apply_cgroup(const char *cgroup_path,
+                                  const struct placement *placement);
+extern int placement_apply_affinity(const struct placement *placement);
+extern void placement_release(struct placement *placement);
+
+#endif
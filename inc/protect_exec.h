@@ -1,8 +1,81 @@
 #ifndef _PROTECT_EXEC_H
 #define _PROTECT_EXEC_H
 
+#include <sys/types.h>
+
+// Launch parameters accepted by protect_exec_ex(3). Always initialize with
+// protect_exec_opts_init(3) so that fields added later keep their defaults.
+struct protect_exec_opts {
+	uid_t uid;
+	const char *fs_path;
+	const char *mnt_path;
+	const char *cgroup_path;
+	const char *exec_path;
+	char *const *argv;
+	char *const *envp;
+
+	// Descriptors to install as stdin, stdout and stderr of the contained
+	// program. A negative value inherits the caller's descriptor.
+	int stdio_fds[3];
+
+	// CPUs and memory nodes to confine the sandbox to, in cpuset list format
+	// (e.g. "0-3,8"). They are written to cpuset.cpus and cpuset.mems of a
+	// cgroup created below 'cgroup_path' for this launch alone and removed
+	// after it, and the program is pinned to the CPUs. Memory nodes default
+	// to the nodes of the chosen CPUs. NULL leaves placement alone.
+	const char *cpus;
+	const char *mems;
+
+	// When 'cpus' is NULL, pin the sandbox to this many of the CPUs running
+	// the fewest sandboxes launched by this process, preferring a single
+	// NUMA node. Sandboxes of other processes and any other load are not
+	// counted. 0 disables automatic placement.
+	int auto_cpus;
+
+	// Limits on the time the sandbox may run, in milliseconds. 0 disables a
+	// limit. A limited sandbox joins a cgroup created below 'cgroup_path'
+	// for this launch alone. When a limit is hit, every process in that
+	// cgroup is killed. CPU time is that of the cgroup when it exposes
+	// cpu.stat (v2) or cpuacct.usage (v1). Otherwise, it is that of each
+	// process, enforced with RLIMIT_CPU at a granularity of one second.
+	unsigned int wall_timeout_ms;
+	unsigned int cpu_timeout_ms;
+};
+
+// Values of 'deadline_exceeded' in struct protect_exec_result
+#define PROTECT_EXEC_DEADLINE_NONE 0
+#define PROTECT_EXEC_DEADLINE_WALL 1
+#define PROTECT_EXEC_DEADLINE_CPU  2
+
+// Outcome of a launch performed by protect_exec_ex(3).
+struct protect_exec_result {
+	// Wait status of the contained program, as reported by waitpid(2).
+	int status;
+
+	// Which limit, if any, caused the sandbox to be killed.
+	int deadline_exceeded;
+};
+
 extern int protect_exec(uid_t uid, const char *fs_path, const char *mnt_path,
                         const char *cgroup_path, const char *exec_path,
                         char *const argv[], char *const envp[]);
 
+extern void protect_exec_opts_init(struct protect_exec_opts *opts);
+
+extern int protect_exec_ex(const struct protect_exec_opts *opts,
+                           struct protect_exec_result *result);
+
+extern void protect_exec_drain(void);
+
+// A sandbox kept running between commands. See protect_exec_session_open(3).
+struct protect_exec_session;
+
+extern struct protect_exec_session *protect_exec_session_open(const struct protect_exec_opts *opts);
+
+extern int protect_exec_session_run(struct protect_exec_session *session,
+                                    const struct protect_exec_opts *opts,
+                                    struct protect_exec_result *result);
+
+extern void protect_exec_session_close(struct protect_exec_session *session);
+
 #endif
@@ -0,0 +1,75 @@
+#ifndef _PROTECT_EXEC_PROTO_H
+#define _PROTECT_EXEC_PROTO_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "protect_exec.h"
+
+#define PEXEC_PROTO_MAGIC   0x70657863
+#define PEXEC_PROTO_VERSION 2
+
+// Bits of 'fd_mask' naming the descriptors attached to a request, in the
+// order in which they appear in the SCM_RIGHTS payload.
+#define PEXEC_PROTO_FD_STDIN  (1<<0)
+#define PEXEC_PROTO_FD_STDOUT (1<<1)
+#define PEXEC_PROTO_FD_STDERR (1<<2)
+#define PEXEC_PROTO_FD_CGROUP (1<<3)
+#define PEXEC_PROTO_MAX_FDS   4
+
+// Fixed header of a launch request. It is followed by the NUL-terminated
+// strings fs_path, mnt_path, cgroup_path, exec_path, 'argc' argv entries and
+// 'envc' envp entries.
+struct pexec_proto_request_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t uid;
+	uint32_t fd_mask;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t wall_timeout_ms;
+	uint32_t cpu_timeout_ms;
+};
+
+struct pexec_proto_response {
+	uint32_t magic;
+	int32_t ret;
+	int32_t error;
+	int32_t status;
+	int32_t deadline_exceeded;
+};
+
+// A decoded launch request. 'opts' points into 'buf' and 'vec', or into a
+// struct pexec_proto_storage; release everything with
+// pexec_proto_request_free().
+struct pexec_proto_request {
+	struct protect_exec_opts opts;
+	int cgroup_fd;
+	char cgroup_fd_path[32];
+	char *buf;
+	char **vec;
+};
+
+// Room for the largest request, for callers that must not allocate. Every
+// string takes at least its NUL, so argv and envp and their terminators
+// never need more than PEXEC_PROTO_MAX_MSG + 2 entries.
+struct pexec_proto_storage {
+	char buf[PEXEC_PROTO_MAX_MSG];
+	char *vec[PEXEC_PROTO_MAX_MSG + 2];
+};
+
+extern int pexec_proto_send_request(int sock,
+                                    const struct protect_exec_opts *opts,
+                                    int cgroup_fd);
+extern int pexec_proto_recv_request(int sock, struct pexec_proto_request *req);
+extern int pexec_proto_recv_request_into(int sock,
+                                         struct pexec_proto_request *req,
+                                         struct pexec_proto_storage *storage);
+extern void pexec_proto_request_free(struct pexec_proto_request *req);
+
+extern int pexec_proto_send_response(int sock, int ret, int error,
+                                     const struct protect_exec_result *result);
+extern int pexec_proto_recv_response(int sock,
+                                     struct protect_exec_result *result);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _PROTECT_EXEC_SANDBOX_H
+#define _PROTECT_EXEC_SANDBOX_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "deadline.h"
+#include "placement.h"
+#include "protect_exec.h"
+
+// A mounted sandbox root and what it holds on to, from sandbox_prepare()
+// until sandbox_release(). 'cgroup_path' is the cgroup the sandbox joins:
+// a leaf created for it when 'cgroup_leaf' is set, otherwise the one given.
+struct sandbox {
+	struct placement placement;
+	char cgroup_path[PATH_MAX];
+	bool cgroup_leaf;
+	int loop_fd;
+	int mnt_fd;
+	char *loop_path;
+};
+
+// Handed to the cloned sandbox child. 'session_sock' is -1 unless the child
+// is to stay behind as a session stub. 'start' is the start of the launch,
+// for its setup latency, or NULL. 'mnt_fd' is the root the child must find
+// at the mount path.
+struct protect_exec_args {
+	const struct protect_exec_opts *opts;
+	const char *cgroup_path;
+	const struct placement *placement;
+	const struct deadline *deadline;
+	const struct timespec *start;
+	int mnt_fd;
+	int session_sock;
+};
+
+extern int protect_exec_validate_input(const struct protect_exec_opts *opts,
+                                       bool need_exec);
+extern int sandbox_prepare(const struct protect_exec_opts *opts,
+                           struct sandbox *sandbox, int *step);
+extern pid_t sandbox_clone(struct protect_exec_args *args, int flags,
+                           int *pidfd);
+extern int sandbox_exec(const struct protect_exec_opts *opts, uid_t uid,
+                        const struct deadline *deadline,
+                        const struct timespec *start, int *step);
+extern void sandbox_release(struct sandbox *sandbox);
+
+#endif
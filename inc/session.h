@@ -0,0 +1,8 @@
+#ifndef _PROTECT_EXEC_SESSION_H
+#define _PROTECT_EXEC_SESSION_H
+
+#include <sys/types.h>
+
+extern int session_serve(int sock, uid_t uid);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _PROTECT_EXEC_TEARDOWN_H
+#define _PROTECT_EXEC_TEARDOWN_H
+
+extern void teardown_defer(int mnt_fd, int loop_fd);
+extern void teardown_wait_path(const char *mnt_path);
+
+#endif
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "config.h"
+#include "dbg.h"
+
+static int inherit_cpuset_file(int parent_fd, int leaf_fd, const char *name);
+static ssize_t read_cgroup_file(int dir_fd, const char *name, char *buf, size_t size);
+
+// Sequence number of the next leaf cgroup created by this process
+static unsigned long leaf_seq = 0;
+
+// Description:
+//   Create a cgroup below 'cgroup_path' for a single launch, so that what is
+//   written to it or read from it concerns that launch alone. On a cpuset
+//   hierarchy that leaves a new cgroup without CPUs or memory nodes
+//   (cgroup v1), the leaf takes those of its parent.
+// Parameters:
+//   leaf_path - Receives the path of the new cgroup.
+//   size - Size of 'leaf_path'.
+// Returns:
+//   0 on success, -1 on failure.
+int cgroup_leaf_create(const char *cgroup_path, char *leaf_path, size_t size)
+{
+	int ret = -1;
+
+	// A leaf left behind by an earlier process with the same PID is skipped
+	for(;;)
+	{
+		unsigned long seq = __atomic_fetch_add(&leaf_seq, 1, __ATOMIC_RELAXED);
+		int length = snprintf(leaf_path, size, "%s/%s-%d-%lu", cgroup_path, CGROUP_LEAF_PREFIX, (int) getpid(), seq);
+
+		if(length < 0 || (size_t) length >= size)
+		{
+			debug("Leaf cgroup path is too long. (cgroup_path: \"%s\")", cgroup_path);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if(mkdir(leaf_path, 0755) == 0)
+		{
+			break;
+		}
+
+		if(errno != EEXIST)
+		{
+			debug("mkdir(2) failed. (errno: %s)", clean_errno());
+			debug("mkdir(\"%s\", 0755)", leaf_path);
+			return -1;
+		}
+	}
+
+	int parent_fd = open(cgroup_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+
+	if(parent_fd == -1)
+	{
+		debug("open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", cgroup_path);
+		goto error_0;
+	}
+
+	int leaf_fd = open(leaf_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+
+	if(leaf_fd == -1)
+	{
+		debug("open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", leaf_path);
+		goto error_1;
+	}
+
+	// Memory nodes first: a cpuset cgroup cannot take tasks until both are set
+	if(inherit_cpuset_file(parent_fd, leaf_fd, "cpuset.mems") ||
+	   inherit_cpuset_file(parent_fd, leaf_fd, "cpuset.cpus"))
+	{
+		goto error_2;
+	}
+
+	ret = 0;
+
+error_2:
+	close(leaf_fd);
+error_1:
+	close(parent_fd);
+error_0:
+	if(ret)
+	{
+		cgroup_leaf_remove(leaf_path);
+	}
+
+	return ret;
+}
+
+// Description:
+//   Remove a leaf cgroup once every process of its launch has been reaped.
+void cgroup_leaf_remove(const char *leaf_path)
+{
+	if(rmdir(leaf_path))
+	{
+		debug("rmdir(2) failed. (errno: %s)", clean_errno());
+		debug("rmdir(\"%s\")", leaf_path);
+	}
+}
+
+// Description:
+//   Copy a cpuset list file of the parent cgroup to the leaf if the leaf's is
+//   empty. An empty list of the parent means "inherit" on cgroup v2 and is
+//   not copied.
+// Returns:
+//   0 on success or if the cgroups have no such file, -1 on failure.
+static int inherit_cpuset_file(int parent_fd, int leaf_fd, const char *name)
+{
+	char list[4096];
+	ssize_t length = read_cgroup_file(leaf_fd, name, list, sizeof(list));
+
+	if(length == -1)
+	{
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	if(length > 0)
+	{
+		return 0;
+	}
+
+	length = read_cgroup_file(parent_fd, name, list, sizeof(list));
+
+	if(length <= 0)
+	{
+		return length;
+	}
+
+	int fd = openat(leaf_fd, name, O_WRONLY|O_CLOEXEC);
+
+	if(fd == -1)
+	{
+		debug("openat(2) failed. (errno: %s)", clean_errno());
+		debug("openat(%d, \"%s\", O_WRONLY|O_CLOEXEC)", leaf_fd, name);
+		return -1;
+	}
+
+	ssize_t written = write(fd, list, (size_t) length);
+	close(fd);
+
+	if(written != length)
+	{
+		debug("write(2) failed. (errno: %s)", clean_errno());
+		debug("write(%d, \"%s\", %zd)", fd, list, length);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Read a single-line cgroup file, without its trailing newline.
+// Returns:
+//   Length of the line, or -1 on failure.
+static ssize_t read_cgroup_file(int dir_fd, const char *name, char *buf, size_t size)
+{
+	int fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC);
+
+	if(fd == -1)
+	{
+		if(errno != ENOENT)
+		{
+			debug("openat(2) failed. (errno: %s)", clean_errno());
+			debug("openat(%d, \"%s\", O_RDONLY|O_CLOEXEC)", dir_fd, name);
+		}
+
+		return -1;
+	}
+
+	ssize_t length = read(fd, buf, size - 1);
+	close(fd);
+
+	if(length == -1)
+	{
+		debug("read(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	buf[length] = 0;
+	length = (ssize_t) strcspn(buf, "\n");
+	buf[length] = 0;
+
+	return length;
+}
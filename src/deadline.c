@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "deadline.h"
+
+static int open_usage(int cgroup_dir_fd, struct deadline *deadline);
+static int read_usage(const struct deadline *deadline, uint64_t *usage_us);
+static int check_cpu(struct deadline *deadline, int cpu_fd, int *exceeded);
+static unsigned int cpu_poll_ms(const struct deadline *deadline, uint64_t used_us);
+static bool rlimit_exceeded(const struct deadline *deadline, pid_t pid);
+static int timer_start(unsigned int ms);
+static int timer_arm(int timer_fd, unsigned int ms);
+static void deadline_kill(const struct deadline *deadline);
+
+// Description:
+//   Open what is needed to enforce the time limits of a launch before it is
+//   cloned: 'cgroup.kill' and the CPU usage counter of the sandbox cgroup,
+//   whose current value is taken as the starting point. Does nothing if no
+//   limit is set.
+// Parameters:
+//   cgroup_path - Cgroup the sandbox joins, which holds no other launch.
+// Returns:
+//   0 on success, -1 on failure.
+int deadline_prepare(const struct protect_exec_opts *opts,
+                     const char *cgroup_path,
+                     struct deadline *deadline)
+{
+	memset(deadline, 0, sizeof(*deadline));
+	deadline->pidfd = -1;
+	deadline->kill_fd = -1;
+	deadline->usage_fd = -1;
+	deadline->wall_timeout_ms = opts->wall_timeout_ms;
+	deadline->cpu_timeout_ms = opts->cpu_timeout_ms;
+	deadline->armed = opts->wall_timeout_ms || opts->cpu_timeout_ms;
+
+	if(!deadline->armed)
+	{
+		return 0;
+	}
+
+	int cgroup_dir_fd = open(cgroup_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+
+	if(cgroup_dir_fd == -1)
+	{
+		debug("open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", cgroup_path);
+		return -1;
+	}
+
+	// 'cgroup.kill' is only found on cgroup v2, from Linux 5.14
+	deadline->kill_fd = openat(cgroup_dir_fd, "cgroup.kill", O_WRONLY|O_CLOEXEC);
+
+	if(deadline->kill_fd == -1)
+	{
+		debug("Cgroup has no 'cgroup.kill'. Killing through the sandbox init process instead.");
+	}
+
+	if(deadline->cpu_timeout_ms && open_usage(cgroup_dir_fd, deadline))
+	{
+		debug("Cgroup has no CPU usage counter. Limiting CPU time with RLIMIT_CPU instead.");
+	}
+
+	deadline->cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(deadline->cpu_count < 1)
+	{
+		deadline->cpu_count = 1;
+	}
+
+	close(cgroup_dir_fd);
+	errno = 0;
+
+	return 0;
+}
+
+// Description:
+//   Limit the CPU time of the calling process and its future children when
+//   the sandbox cgroup cannot account for it. The soft and hard limits are
+//   equal, so that the kernel sends SIGKILL straight away: the init process
+//   of a PID namespace ignores SIGXCPU.
+// Returns:
+//   0 on success, -1 on failure.
+int deadline_apply_rlimit(const struct deadline *deadline)
+{
+	if(deadline->cpu_timeout_ms == 0 || deadline->usage_fd != -1)
+	{
+		return 0;
+	}
+
+	rlim_t seconds = (deadline->cpu_timeout_ms + 999) / 1000;
+	struct rlimit limit = { .rlim_cur = seconds, .rlim_max = seconds };
+
+	if(setrlimit(RLIMIT_CPU, &limit))
+	{
+		debug("setrlimit(2) failed. (errno: %s)", clean_errno());
+		debug("setrlimit(RLIMIT_CPU, { %lu, %lu })", (unsigned long) limit.rlim_cur, (unsigned long) limit.rlim_max);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Block until the sandbox init process exits, killing the whole sandbox as
+//   soon as a time limit is exceeded. The init process is left for the
+//   caller to reap. Returns at once if no limit is set.
+// Parameters:
+//   pid - PID of the sandbox init process, as returned by clone(2).
+//   exceeded - Receives the PROTECT_EXEC_DEADLINE_* value of the limit hit.
+// Returns:
+//   0 on success. -1 on failure, after killing the sandbox.
+int deadline_wait(struct deadline *deadline, pid_t pid, int *exceeded)
+{
+	int ret = -1;
+	int wall_fd = -1;
+	int cpu_fd = -1;
+
+	*exceeded = PROTECT_EXEC_DEADLINE_NONE;
+
+	if(!deadline->armed)
+	{
+		return 0;
+	}
+
+	if(deadline->wall_timeout_ms && (wall_fd = timer_start(deadline->wall_timeout_ms)) == -1)
+	{
+		goto error;
+	}
+
+	if(deadline->usage_fd != -1 && (cpu_fd = timer_start(cpu_poll_ms(deadline, 0))) == -1)
+	{
+		goto error;
+	}
+
+	// poll(2) skips negative descriptors
+	struct pollfd fds[3] = {
+		{ .fd = deadline->pidfd, .events = POLLIN },
+		{ .fd = wall_fd, .events = POLLIN },
+		{ .fd = cpu_fd, .events = POLLIN },
+	};
+
+	for(;;)
+	{
+		if(poll(fds, 3, -1) == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			debug("poll(2) failed. (errno: %s)", clean_errno());
+			goto error;
+		}
+
+		if(fds[0].revents)
+		{
+			break;
+		}
+
+		if(fds[1].revents & POLLIN)
+		{
+			*exceeded = PROTECT_EXEC_DEADLINE_WALL;
+		}
+		else if((fds[2].revents & POLLIN) && check_cpu(deadline, cpu_fd, exceeded))
+		{
+			goto error;
+		}
+
+		if(*exceeded != PROTECT_EXEC_DEADLINE_NONE)
+		{
+			debug("Sandbox exceeded its %s time limit. Killing it.",
+				*exceeded == PROTECT_EXEC_DEADLINE_WALL ? "wall-clock" : "CPU");
+			deadline_kill(deadline);
+
+			// Only wait for the sandbox to die from here on
+			fds[1].fd = fds[2].fd = -1;
+		}
+	}
+
+	if(*exceeded == PROTECT_EXEC_DEADLINE_NONE && rlimit_exceeded(deadline, pid))
+	{
+		*exceeded = PROTECT_EXEC_DEADLINE_CPU;
+	}
+
+	ret = 0;
+
+error:
+	if(ret)
+	{
+		deadline_kill(deadline);
+	}
+
+	if(cpu_fd != -1)
+	{
+		close(cpu_fd);
+	}
+
+	if(wall_fd != -1)
+	{
+		close(wall_fd);
+	}
+
+	return ret;
+}
+
+void deadline_release(struct deadline *deadline)
+{
+	if(deadline->pidfd != -1)
+	{
+		close(deadline->pidfd);
+	}
+
+	if(deadline->kill_fd != -1)
+	{
+		close(deadline->kill_fd);
+	}
+
+	if(deadline->usage_fd != -1)
+	{
+		close(deadline->usage_fd);
+	}
+
+	deadline->pidfd = deadline->kill_fd = deadline->usage_fd = -1;
+}
+
+// Description:
+//   Open the CPU usage counter of a cgroup and record its current value:
+//   'usage_usec' of cpu.stat on cgroup v2, cpuacct.usage on v1. A v1
+//   cpu.stat has no usage counter and is passed over.
+// Returns:
+//   0 on success, -1 if the cgroup has no usable counter.
+static int open_usage(int cgroup_dir_fd, struct deadline *deadline)
+{
+	static const char *const names[] = { "cpu.stat", "cpuacct.usage" };
+
+	for(int i = 0; i < 2; i++)
+	{
+		deadline->usage_fd = openat(cgroup_dir_fd, names[i], O_RDONLY|O_CLOEXEC);
+		deadline->usage_ns = i == 1;
+
+		if(deadline->usage_fd == -1)
+		{
+			continue;
+		}
+
+		if(read_usage(deadline, &deadline->usage_base_us) == 0)
+		{
+			return 0;
+		}
+
+		close(deadline->usage_fd);
+		deadline->usage_fd = -1;
+	}
+
+	return -1;
+}
+
+// Returns:
+//   0 on success, -1 on failure.
+static int read_usage(const struct deadline *deadline, uint64_t *usage_us)
+{
+	char buf[1024];
+	ssize_t size = pread(deadline->usage_fd, buf, sizeof(buf) - 1, 0);
+
+	if(size <= 0)
+	{
+		debug("pread(2) failed. (errno: %s)", clean_errno());
+		debug("pread(%d, %p, %zu, 0)", deadline->usage_fd, (void *) buf, sizeof(buf) - 1);
+		return -1;
+	}
+
+	buf[size] = 0;
+
+	if(deadline->usage_ns)
+	{
+		*usage_us = strtoull(buf, NULL, 10) / 1000;
+		return 0;
+	}
+
+	char *usage = strstr(buf, "usage_usec ");
+
+	if(usage == NULL)
+	{
+		return -1;
+	}
+
+	*usage_us = strtoull(usage + strlen("usage_usec "), NULL, 10);
+
+	return 0;
+}
+
+// Description:
+//   Compare the CPU time used by the sandbox so far with its limit, and
+//   schedule the next comparison if it is still under.
+// Returns:
+//   0 on success, -1 on failure.
+static int check_cpu(struct deadline *deadline, int cpu_fd, int *exceeded)
+{
+	uint64_t expirations;
+	uint64_t usage_us;
+
+	if(read(cpu_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+	{
+		debug("read(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	if(read_usage(deadline, &usage_us))
+	{
+		return -1;
+	}
+
+	uint64_t used_us = usage_us > deadline->usage_base_us ? usage_us - deadline->usage_base_us : 0;
+
+	if(used_us >= (uint64_t) deadline->cpu_timeout_ms * 1000)
+	{
+		*exceeded = PROTECT_EXEC_DEADLINE_CPU;
+		return 0;
+	}
+
+	return timer_arm(cpu_fd, cpu_poll_ms(deadline, used_us));
+}
+
+// Description:
+//   The sandbox cannot use more CPU time than the online CPUs provide in the
+//   same wall-clock time, so the next usage read can wait for that long, but
+//   no less than DEADLINE_CPU_POLL_MS.
+static unsigned int cpu_poll_ms(const struct deadline *deadline, uint64_t used_us)
+{
+	uint64_t remaining_ms = deadline->cpu_timeout_ms - used_us / 1000;
+	uint64_t poll_ms = remaining_ms / (uint64_t) deadline->cpu_count;
+
+	return poll_ms < DEADLINE_CPU_POLL_MS ? DEADLINE_CPU_POLL_MS : (unsigned int) poll_ms;
+}
+
+// Description:
+//   Tell whether the sandbox init process, exited but not yet reaped, was
+//   killed by RLIMIT_CPU: killed by SIGKILL after using up its CPU time,
+//   according to /proc/PID/stat.
+static bool rlimit_exceeded(const struct deadline *deadline, pid_t pid)
+{
+	siginfo_t info;
+	memset(&info, 0, sizeof(info));
+
+	if(deadline->cpu_timeout_ms == 0 || deadline->usage_fd != -1 ||
+	   waitid(P_PID, pid, &info, WEXITED|WNOWAIT) || info.si_code == CLD_EXITED ||
+	   info.si_status != SIGKILL)
+	{
+		return false;
+	}
+
+	char stat_path[32];
+	char stat[1024];
+	snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", pid);
+
+	FILE *stat_file = fopen(stat_path, "r");
+
+	if(stat_file == NULL)
+	{
+		return false;
+	}
+
+	size_t size = fread(stat, 1, sizeof(stat) - 1, stat_file);
+	fclose(stat_file);
+	stat[size] = 0;
+
+	// Fields 14 and 15, utime and stime, counted from the end of the
+	// parenthesized command name
+	char *fields = strrchr(stat, ')');
+	unsigned long utime;
+	unsigned long stime;
+
+	if(fields == NULL || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+	{
+		return false;
+	}
+
+	unsigned long limit_ticks = (deadline->cpu_timeout_ms + 999) / 1000 * (unsigned long) sysconf(_SC_CLK_TCK);
+
+	// utime and stime are each scaled down to whole ticks from the runtime
+	// the kernel checked against the limit, and can fall a few ticks short
+	return utime + stime >= limit_ticks - limit_ticks / 20;
+}
+
+// Returns:
+//   A timerfd expiring once after 'ms' milliseconds, or -1 on failure.
+static int timer_start(unsigned int ms)
+{
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+	if(timer_fd == -1)
+	{
+		debug("timerfd_create(2) failed. (errno: %s)", clean_errno());
+		debug("timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)");
+		return -1;
+	}
+
+	if(timer_arm(timer_fd, ms))
+	{
+		close(timer_fd);
+		return -1;
+	}
+
+	return timer_fd;
+}
+
+// Returns:
+//   0 on success, -1 on failure.
+static int timer_arm(int timer_fd, unsigned int ms)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = ms / 1000;
+	spec.it_value.tv_nsec = (long) (ms % 1000) * 1000000;
+
+	if(timerfd_settime(timer_fd, 0, &spec, NULL))
+	{
+		debug("timerfd_settime(2) failed. (errno: %s)", clean_errno());
+		debug("timerfd_settime(%d, 0, { %u ms }, NULL)", timer_fd, ms);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Kill every process in the sandbox at once: through 'cgroup.kill' when
+//   available, otherwise by killing the init process of its PID namespace,
+//   which takes the rest of the namespace with it.
+static void deadline_kill(const struct deadline *deadline)
+{
+	if(deadline->kill_fd != -1)
+	{
+		if(write(deadline->kill_fd, "1", 1) == 1)
+		{
+			return;
+		}
+
+		debug("write(2) failed. (errno: %s)", clean_errno());
+		debug("write(%d, \"1\", 1)", deadline->kill_fd);
+	}
+
+	if(syscall(__NR_pidfd_send_signal, deadline->pidfd, SIGKILL, NULL, 0))
+	{
+		debug("pidfd_send_signal(2) failed. (errno: %s)", clean_errno());
+		debug("pidfd_send_signal(%d, SIGKILL, NULL, 0)", deadline->pidfd);
+	}
+}
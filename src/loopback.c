@@ -8,30 +8,56 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "dbg.h"
+#include "loopback.h"
+#include "metrics.h"
 
-static char *loopback_assign(const char *filename, int dir_fd, DIR *dir);
+static char *loopback_assign(const char *filename, int dir_fd, DIR *dir,
+                             int *loop_fd_out);
+static void loopback_autoclear(int loop_fd);
 static char *fd_path(int fd);
 
 // Description:
 //   Assign an available loopback device to a given file.
 // Parameters:
 //   filename - Full path of file to assign to a loopback device
+//   loop_fd - Receives an open descriptor of the assigned loopback device.
+//             The device is set to LO_FLAGS_AUTOCLEAR where supported, so it
+//             must stay open until the device has been mounted; release it
+//             with loopback_release().
 // Return:
 //   Full path of loopback device file.
 //   NULL on error, non-NULL on success
-char *loopback_setup(const char *filename)
+char *loopback_setup(const char *filename, int *loop_fd)
 {
     const char *dev_dir_path = LOOPBACK_DEV_DIR;
 
+    char *loopback_device_path = NULL;
     int dev_dir_fd = open(dev_dir_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+
+    if(dev_dir_fd == -1)
+    {
+        debug("open(2) failed. (errno: %s)", clean_errno());
+        debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", dev_dir_path);
+        return NULL;
+    }
+
     DIR *dev_dir = opendir(dev_dir_path);
-    
-    char *loopback_device_path = loopback_assign(filename, dev_dir_fd, dev_dir);
+
+    if(dev_dir == NULL)
+    {
+        debug("opendir(3) failed. (errno: %s)", clean_errno());
+        debug("opendir(\"%s\")", dev_dir_path);
+        close(dev_dir_fd);
+        return NULL;
+    }
+
+    loopback_device_path = loopback_assign(filename, dev_dir_fd, dev_dir, loop_fd);
 
     close(dev_dir_fd);
     closedir(dev_dir);
@@ -56,7 +82,8 @@ char *loopback_setup(const char *filename)
 //      > cap_t cap = cap_get_proc();
 //      > bool can_mknod = cap_get_flag(cap, CAP_MKNOD, ... );
 //      > ...
-static char *loopback_assign(const char *filename, int dir_fd, DIR *dir)
+static char *loopback_assign(const char *filename, int dir_fd, DIR *dir,
+                             int *loop_fd_out)
 {
     struct dirent *de;
     struct stat device_stat;
@@ -77,7 +104,7 @@ static char *loopback_assign(const char *filename, int dir_fd, DIR *dir)
        major(device_stat.st_rdev) != 7)
     {
         debug("Ignoring non-loopback file. (filename: \"%s\")", de->d_name);
-        return loopback_assign(filename, dir_fd, dir);
+        return loopback_assign(filename, dir_fd, dir, loop_fd_out);
     }
 
     // Open the loopback device
@@ -122,28 +149,28 @@ static char *loopback_assign(const char *filename, int dir_fd, DIR *dir)
                 debug("ioctl(%d, LOOP_SET_FD, %d)", loop_fd, file_fd);
             }
 
-            int ret_file_close = close(file_fd);
-            
-            if(ret_file_close)
+            if(close(file_fd))
             {
                 debug("close(2) failed. (errno: %s)", clean_errno());
                 debug("close(%d)", file_fd);
             }
 
-            if(!ret_ioctl && !ret_file_close)
+            if(!ret_ioctl)
             {
+                // The device is ours from here on, so it must be released
+                // on every failure below.
+                loopback_autoclear(loop_fd);
+                metrics_add_loops(1);
+
                 char *loop_path = fd_path(loop_fd);
 
-                if(close(loop_fd))
+                if(loop_path == NULL)
                 {
-                    if(loop_path != NULL)
-                    {
-                        free(loop_path);
-                    }
-
+                    loopback_release(loop_fd);
                     return NULL;
                 }
 
+                *loop_fd_out = loop_fd;
                 return loop_path;
             }
         }
@@ -156,7 +183,57 @@ static char *loopback_assign(const char *filename, int dir_fd, DIR *dir)
         }
     }
     
-    return loopback_assign(filename, dir_fd, dir);
+    return loopback_assign(filename, dir_fd, dir, loop_fd_out);
+}
+
+// Description:
+//   Close a descriptor returned by loopback_setup(). A device with
+//   LO_FLAGS_AUTOCLEAR set is detached by the kernel once it is neither open
+//   nor mounted; any other device is detached explicitly. Since the kernel
+//   turns LOOP_CLR_FD on a busy device into LO_FLAGS_AUTOCLEAR, this is safe
+//   to call while the device is still (lazily) mounted.
+void loopback_release(int loop_fd)
+{
+    struct loop_info64 info;
+
+    if(ioctl(loop_fd, LOOP_GET_STATUS64, &info) == 0 &&
+       !(info.lo_flags & LO_FLAGS_AUTOCLEAR) &&
+       ioctl(loop_fd, LOOP_CLR_FD))
+    {
+        debug("ioctl(2) failed. (errno: %s)", clean_errno());
+        debug("ioctl(%d, LOOP_CLR_FD)", loop_fd);
+    }
+
+    if(close(loop_fd))
+    {
+        debug("close(2) failed. (errno: %s)", clean_errno());
+        debug("close(%d)", loop_fd);
+    }
+
+    metrics_add_loops(-1);
+}
+
+// Description:
+//   Have the kernel detach a bound loopback device on last close or unmount.
+//   Failure is not fatal: loopback_release() falls back to LOOP_CLR_FD.
+static void loopback_autoclear(int loop_fd)
+{
+    struct loop_info64 info;
+
+    if(ioctl(loop_fd, LOOP_GET_STATUS64, &info))
+    {
+        debug("ioctl(2) failed. (errno: %s)", clean_errno());
+        debug("ioctl(%d, LOOP_GET_STATUS64, %p)", loop_fd, (void *) &info);
+        return;
+    }
+
+    info.lo_flags |= LO_FLAGS_AUTOCLEAR;
+
+    if(ioctl(loop_fd, LOOP_SET_STATUS64, &info))
+    {
+        debug("ioctl(2) failed. (errno: %s)", clean_errno());
+        debug("ioctl(%d, LOOP_SET_STATUS64, %p)", loop_fd, (void *) &info);
+    }
 }
 
 static char *fd_path(int fd)
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "metrics.h"
+
+static struct metrics_segment *metrics_get(void);
+static void segment_map(void);
+static void observe(struct metrics_histogram *histogram, const struct timespec *start);
+static void add(uint64_t *counter, uint64_t value);
+
+// Shared segment of this process, mapped on first use. NULL if METRICS is
+// disabled or the segment could not be mapped, in which case every update
+// is a no-op. The mapping is inherited by cloned sandbox children, which
+// report failures of the steps they perform through it.
+static pthread_once_t segment_once = PTHREAD_ONCE_INIT;
+static struct metrics_segment *segment = NULL;
+
+void metrics_count_launch(void)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL)
+	{
+		add(&metrics->launches, 1);
+	}
+}
+
+void metrics_count_failure(int step)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL && step >= 0 && step < METRICS_STEPS)
+	{
+		add(&metrics->failures[step], 1);
+	}
+}
+
+void metrics_count_deadline(int deadline)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL && deadline > 0 && deadline < 3)
+	{
+		add(&metrics->deadlines_exceeded[deadline], 1);
+	}
+}
+
+void metrics_add_sandboxes(int delta)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL)
+	{
+		__atomic_fetch_add(&metrics->sandboxes_active, delta, __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_add_loops(int delta)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL)
+	{
+		__atomic_fetch_add(&metrics->loops_in_use, delta, __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_observe_setup(const struct timespec *start)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL)
+	{
+		observe(&metrics->setup_latency, start);
+	}
+}
+
+void metrics_observe_teardown(const struct timespec *start)
+{
+	struct metrics_segment *metrics = metrics_get();
+
+	if(metrics != NULL)
+	{
+		observe(&metrics->teardown_latency, start);
+	}
+}
+
+static struct metrics_segment *metrics_get(void)
+{
+	pthread_once(&segment_once, segment_map);
+
+	return segment;
+}
+
+// Description:
+//   Open or create the segment and map it. Only root creates it, and only a
+//   segment owned by the effective UID is used, so that an unprivileged
+//   process cannot plant one that root then writes to. The process that
+//   sets 'magic' fills in the rest of the header; counters start out zeroed
+//   by ftruncate(2). A segment of another owner, size or version is left
+//   alone and metrics are disabled for this process.
+static void segment_map(void)
+{
+#if METRICS
+	uid_t euid = geteuid();
+	int flags = O_RDWR|O_CLOEXEC|(euid == 0 ? O_CREAT : 0);
+	int fd = shm_open(METRICS_SHM_NAME, flags, 0644);
+
+	if(fd == -1)
+	{
+		debug("shm_open(3) failed. Metrics disabled. (errno: %s)", clean_errno());
+		debug("shm_open(\"%s\", %#x, 0644)", METRICS_SHM_NAME, flags);
+		return;
+	}
+
+	struct stat st;
+
+	if(fstat(fd, &st))
+	{
+		debug("fstat(2) failed. Metrics disabled. (errno: %s)", clean_errno());
+		goto out;
+	}
+
+	if(st.st_uid != euid)
+	{
+		debug("Metrics segment is owned by another user. Metrics disabled. (uid: %d)", (int) st.st_uid);
+		goto out;
+	}
+
+	if(st.st_size == 0 && ftruncate(fd, sizeof(struct metrics_segment)))
+	{
+		debug("ftruncate(2) failed. Metrics disabled. (errno: %s)", clean_errno());
+		goto out;
+	}
+
+	if(st.st_size != 0 && (size_t) st.st_size != sizeof(struct metrics_segment))
+	{
+		debug("Metrics segment has an unexpected size. Metrics disabled. (size: %lld)", (long long) st.st_size);
+		goto out;
+	}
+
+	struct metrics_segment *metrics = mmap(NULL, sizeof(*metrics), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if(metrics == MAP_FAILED)
+	{
+		debug("mmap(2) failed. Metrics disabled. (errno: %s)", clean_errno());
+		goto out;
+	}
+
+	uint32_t magic = 0;
+
+	if(__atomic_compare_exchange_n(&metrics->magic, &magic, METRICS_MAGIC, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		static const uint64_t bounds_us[METRICS_LATENCY_BUCKETS] = METRICS_LATENCY_BOUNDS_US;
+
+		for(int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+		{
+			__atomic_store_n(&metrics->bounds_us[i], bounds_us[i], __ATOMIC_RELAXED);
+		}
+
+		__atomic_store_n(&metrics->size, sizeof(*metrics), __ATOMIC_RELAXED);
+
+		// Readers wait for 'version' before trusting the header
+		__atomic_store_n(&metrics->version, METRICS_VERSION, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		// Version 0: another process is still filling in the header
+		uint32_t version = __atomic_load_n(&metrics->version, __ATOMIC_ACQUIRE);
+
+		if(magic != METRICS_MAGIC || (version != 0 && version != METRICS_VERSION))
+		{
+			debug("Metrics segment has an unexpected layout. Metrics disabled. (magic: %x, version: %u)", magic, version);
+			munmap(metrics, sizeof(*metrics));
+			goto out;
+		}
+	}
+
+	segment = metrics;
+
+out:
+	close(fd);
+#endif
+}
+
+// Description:
+//   Add the time elapsed since 'start' to a histogram.
+static void observe(struct metrics_histogram *histogram, const struct timespec *start)
+{
+	static const uint64_t bounds_us[METRICS_LATENCY_BUCKETS] = METRICS_LATENCY_BOUNDS_US;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t elapsed_us = (int64_t) (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+	uint64_t value_us = elapsed_us > 0 ? (uint64_t) elapsed_us : 0;
+	int bucket = 0;
+
+	while(value_us > bounds_us[bucket])
+	{
+		bucket++;
+	}
+
+	add(&histogram->counts[bucket], 1);
+	add(&histogram->sum_us, value_us);
+}
+
+static void add(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
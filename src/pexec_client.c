@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "pexec_client.h"
+#include "proto.h"
+
+// Description:
+//   Have a running pexecd(8) perform protect_exec_ex(3) on behalf of the
+//   caller, which needs no privileges beyond access to the daemon's socket.
+// Parameters:
+//   socket_path - Path of the daemon's socket. NULL selects
+//                 PEXECD_SOCKET_PATH (see config.h).
+//   opts - Launch parameters. Non-negative 'stdio_fds' entries are passed to
+//          the daemon and become the contained program's stdio.
+//   cgroup_fd - Directory descriptor of the cgroup the contained program
+//               should join, or -1 to use 'opts->cgroup_path' as seen by the
+//               daemon.
+//   result - Receives the outcome of the launch. May be NULL.
+// Returns:
+//   0 if the contained program was launched and reaped, -1 on failure with
+//   errno set by the daemon or by the transport.
+int pexec_client_launch(const char *socket_path,
+                        const struct protect_exec_opts *opts,
+                        int cgroup_fd,
+                        struct protect_exec_result *result)
+{
+	int ret = -1;
+	struct sockaddr_un addr;
+
+	if(socket_path == NULL)
+	{
+		socket_path = PEXECD_SOCKET_PATH;
+	}
+
+	if(opts == NULL || opts->fs_path == NULL || opts->mnt_path == NULL ||
+	   opts->exec_path == NULL || opts->argv == NULL || opts->envp == NULL ||
+	   (opts->cgroup_path == NULL && cgroup_fd < 0) ||
+	   strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		debug("pexec_client_launch(3) input is invalid.");
+		errno = EINVAL;
+		goto error_0;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+
+	if(sock == -1)
+	{
+		debug("socket(2) failed. (errno: %s)", clean_errno());
+		debug("socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0)");
+		goto error_0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		debug("connect(2) failed. (errno: %s)", clean_errno());
+		debug("connect(%d, \"%s\")", sock, socket_path);
+		goto error_1;
+	}
+
+	if(pexec_proto_send_request(sock, opts, cgroup_fd))
+	{
+		debug("pexec_client_launch(3) failed. Could not send launch request. (errno: %s)", clean_errno());
+		goto error_1;
+	}
+
+	ret = pexec_proto_recv_response(sock, result);
+
+error_1:
+	{
+		// Preserve the daemon's errno across close(2)
+		int saved_errno = errno;
+		close(sock);
+		errno = saved_errno;
+	}
+error_0:
+	return ret;
+}
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "placement.h"
+
+static int select_least_loaded(int count, cpu_set_t *cpus);
+static void nodes_of_cpus(const cpu_set_t *cpus, cpu_set_t *nodes);
+static void topology_load(void);
+static int parse_cpu_list(const char *list, cpu_set_t *set);
+static void format_cpu_list(const cpu_set_t *set, char *list, size_t size);
+static int write_cpuset_file(int dir_fd, const char *name, const char *list);
+
+// Sandboxes currently pinned to each CPU by automatic placement, and the CPU
+// at which the next search for the least loaded one starts, so that ties are
+// spread round-robin.
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cpu_load[CPU_SETSIZE];
+static int next_cpu = 0;
+
+// NUMA node of every CPU, read once from sysfs. All CPUs are on node 0 on
+// kernels without NUMA support.
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int cpu_node[CPU_SETSIZE];
+
+// Description:
+//   Work out where a launch should run from its 'cpus', 'mems' and
+//   'auto_cpus' options. Memory nodes default to the nodes of the chosen
+//   CPUs. Automatically chosen CPUs are claimed until placement_release().
+// Returns:
+//   0 on success, -1 on failure.
+int placement_resolve(const struct protect_exec_opts *opts,
+                      struct placement *placement)
+{
+	memset(placement, 0, sizeof(*placement));
+
+	if(opts->cpus != NULL)
+	{
+		if(parse_cpu_list(opts->cpus, &placement->cpus) || CPU_COUNT(&placement->cpus) == 0)
+		{
+			debug("Invalid CPU list. (cpus: \"%s\")", opts->cpus);
+			errno = EINVAL;
+			return -1;
+		}
+
+		placement->cpus_set = true;
+	}
+	else if(opts->auto_cpus > 0)
+	{
+		if(select_least_loaded(opts->auto_cpus, &placement->cpus))
+		{
+			return -1;
+		}
+
+		placement->cpus_set = true;
+		placement->claimed = true;
+	}
+
+	if(placement->cpus_set)
+	{
+		format_cpu_list(&placement->cpus, placement->cpus_list, sizeof(placement->cpus_list));
+	}
+
+	cpu_set_t nodes;
+
+	if(opts->mems != NULL)
+	{
+		if(parse_cpu_list(opts->mems, &nodes) || CPU_COUNT(&nodes) == 0)
+		{
+			debug("Invalid memory node list. (mems: \"%s\")", opts->mems);
+			errno = EINVAL;
+			placement_release(placement);
+			return -1;
+		}
+
+		placement->mems_set = true;
+	}
+	else if(placement->cpus_set)
+	{
+		nodes_of_cpus(&placement->cpus, &nodes);
+		placement->mems_set = true;
+	}
+
+	if(placement->mems_set)
+	{
+		format_cpu_list(&nodes, placement->mems_list, sizeof(placement->mems_list));
+	}
+
+	debug("Placement resolved. (cpus: \"%s\", mems: \"%s\")", placement->cpus_list, placement->mems_list);
+
+	return 0;
+}
+
+// Description:
+//   Confine a cgroup to the placement through its cpuset.mems and
+//   cpuset.cpus files. A cgroup without the cpuset controller is left alone;
+//   the launch is then only pinned through placement_apply_affinity().
+// Returns:
+//   0 on success, -1 on failure.
+int placement_apply_cgroup(const char *cgroup_path,
+                           const struct placement *placement)
+{
+	int ret = -1;
+
+	if(!placement->cpus_set && !placement->mems_set)
+	{
+		return 0;
+	}
+
+	int dir_fd = open(cgroup_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+
+	if(dir_fd == -1)
+	{
+		debug("open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", cgroup_path);
+		return -1;
+	}
+
+	// Memory nodes first: a cpuset cgroup cannot take tasks until both are set
+	if(placement->mems_set && write_cpuset_file(dir_fd, "cpuset.mems", placement->mems_list))
+	{
+		goto error;
+	}
+
+	if(placement->cpus_set && write_cpuset_file(dir_fd, "cpuset.cpus", placement->cpus_list))
+	{
+		goto error;
+	}
+
+	ret = 0;
+
+error:
+	close(dir_fd);
+	return ret;
+}
+
+// Description:
+//   Pin the calling process to the placement CPUs. The affinity mask is
+//   inherited across execve(2).
+// Returns:
+//   0 on success, -1 on failure.
+int placement_apply_affinity(const struct placement *placement)
+{
+	if(placement->cpus_set && sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus))
+	{
+		debug("sched_setaffinity(2) failed. (errno: %s)", clean_errno());
+		debug("sched_setaffinity(0, %zu, \"%s\")", sizeof(placement->cpus), placement->cpus_list);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Give back CPUs claimed by automatic placement once the sandbox is gone.
+void placement_release(struct placement *placement)
+{
+	if(!placement->claimed)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&load_lock);
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, &placement->cpus) && cpu_load[cpu] > 0)
+		{
+			cpu_load[cpu]--;
+		}
+	}
+
+	pthread_mutex_unlock(&load_lock);
+
+	placement->claimed = false;
+}
+
+// Description:
+//   Claim the 'count' CPUs running the fewest sandboxes among those the
+//   caller may run on. CPUs after the first are taken from the first one's
+//   NUMA node while it has any left, so that a sandbox stays node-local.
+// Returns:
+//   0 on success, -1 on failure.
+static int select_least_loaded(int count, cpu_set_t *cpus)
+{
+	cpu_set_t allowed;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed))
+	{
+		debug("sched_getaffinity(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	pthread_once(&topology_once, topology_load);
+	pthread_mutex_lock(&load_lock);
+
+	CPU_ZERO(cpus);
+	int node = -1;
+
+	for(int chosen = 0; chosen < count; chosen++)
+	{
+		int best = -1;
+		bool best_on_node = false;
+
+		for(int i = 0; i < CPU_SETSIZE; i++)
+		{
+			int cpu = (next_cpu + i) % CPU_SETSIZE;
+
+			if(!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, cpus))
+			{
+				continue;
+			}
+
+			bool on_node = cpu_node[cpu] == node;
+
+			if(best == -1 || (on_node && !best_on_node) ||
+			   (on_node == best_on_node && cpu_load[cpu] < cpu_load[best]))
+			{
+				best = cpu;
+				best_on_node = on_node;
+			}
+		}
+
+		if(best == -1)
+		{
+			// Fewer CPUs are available than requested
+			break;
+		}
+
+		if(node == -1)
+		{
+			node = cpu_node[best];
+		}
+
+		CPU_SET(best, cpus);
+		cpu_load[best]++;
+		next_cpu = (best + 1) % CPU_SETSIZE;
+	}
+
+	pthread_mutex_unlock(&load_lock);
+
+	if(CPU_COUNT(cpus) == 0)
+	{
+		debug("No CPU available for automatic placement.");
+		errno = ENODEV;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Compute the set of NUMA nodes hosting the given CPUs.
+static void nodes_of_cpus(const cpu_set_t *cpus, cpu_set_t *nodes)
+{
+	pthread_once(&topology_once, topology_load);
+
+	CPU_ZERO(nodes);
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, cpus))
+		{
+			CPU_SET(cpu_node[cpu], nodes);
+		}
+	}
+}
+
+// Description:
+//   Fill 'cpu_node' from /sys/devices/system/node/node*/cpulist.
+static void topology_load(void)
+{
+	const char *node_dir_path = "/sys/devices/system/node";
+	DIR *node_dir = opendir(node_dir_path);
+
+	if(node_dir == NULL)
+	{
+		debug("opendir(3) failed. Assuming a single NUMA node. (errno: %s)", clean_errno());
+		return;
+	}
+
+	struct dirent *de;
+
+	while((de = readdir(node_dir)))
+	{
+		int node;
+		char cpulist_path[PATH_MAX];
+		char cpulist[PLACEMENT_LIST_MAX];
+		cpu_set_t node_cpus;
+
+		if(sscanf(de->d_name, "node%d", &node) != 1 || node < 0 || node >= CPU_SETSIZE)
+		{
+			continue;
+		}
+
+		snprintf(cpulist_path, sizeof(cpulist_path), "%s/%s/cpulist", node_dir_path, de->d_name);
+
+		FILE *cpulist_file = fopen(cpulist_path, "r");
+
+		if(cpulist_file == NULL)
+		{
+			continue;
+		}
+
+		if(fgets(cpulist, sizeof(cpulist), cpulist_file) != NULL &&
+		   parse_cpu_list(cpulist, &node_cpus) == 0)
+		{
+			for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			{
+				if(CPU_ISSET(cpu, &node_cpus))
+				{
+					cpu_node[cpu] = node;
+				}
+			}
+		}
+
+		fclose(cpulist_file);
+	}
+
+	closedir(node_dir);
+}
+
+// Description:
+//   Parse a cpuset list such as "0-3,8,10-11". Also used for memory node
+//   lists, which share the format.
+// Returns:
+//   0 on success, -1 on failure.
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	const char *cursor = list;
+
+	CPU_ZERO(set);
+
+	while(*cursor != 0 && !isspace((unsigned char) *cursor))
+	{
+		char *end;
+		long first = strtol(cursor, &end, 10);
+		long last = first;
+
+		if(end == cursor)
+		{
+			return -1;
+		}
+
+		if(*end == '-')
+		{
+			cursor = end + 1;
+			last = strtol(cursor, &end, 10);
+
+			if(end == cursor)
+			{
+				return -1;
+			}
+		}
+
+		if(first < 0 || last < first || last >= CPU_SETSIZE)
+		{
+			return -1;
+		}
+
+		for(long cpu = first; cpu <= last; cpu++)
+		{
+			CPU_SET(cpu, set);
+		}
+
+		cursor = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static void format_cpu_list(const cpu_set_t *set, char *list, size_t size)
+{
+	size_t used = 0;
+
+	list[0] = 0;
+
+	for(int cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++)
+	{
+		if(!CPU_ISSET(cpu, set))
+		{
+			continue;
+		}
+
+		int last = cpu;
+
+		while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+		{
+			last++;
+		}
+
+		used += snprintf(list + used, size - used, used ? ",%d" : "%d", cpu);
+
+		if(last > cpu && used < size)
+		{
+			used += snprintf(list + used, size - used, "-%d", last);
+		}
+
+		cpu = last;
+	}
+}
+
+// Returns:
+//   0 on success or if the cgroup has no such file, -1 on failure.
+static int write_cpuset_file(int dir_fd, const char *name, const char *list)
+{
+	int fd = openat(dir_fd, name, O_WRONLY|O_CLOEXEC);
+
+	if(fd == -1)
+	{
+		if(errno == ENOENT)
+		{
+			debug("Cgroup has no '%s'. Relying on CPU affinity alone.", name);
+			errno = 0;
+			return 0;
+		}
+
+		debug("openat(2) failed. (errno: %s)", clean_errno());
+		debug("openat(%d, \"%s\", O_WRONLY|O_CLOEXEC)", dir_fd, name);
+		return -1;
+	}
+
+	size_t list_size = strlen(list);
+	ssize_t written = write(fd, list, list_size);
+
+	if((size_t) written != list_size)
+	{
+		debug("write(2) failed. (errno: %s)", clean_errno());
+		debug("write(%d, \"%s\", %zu)", fd, list, list_size);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
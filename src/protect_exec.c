@@ -8,38 +8,50 @@
 #include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+// struct mount_attr and MOUNT_ATTR_* for mount_setattr(2). glibc 2.36 and
+// later include the kernel header from <sys/mount.h> themselves; earlier
+// ones must see it after <sys/mount.h>, whose MS_* enum it would clobber.
+#ifndef MOUNT_ATTR_RDONLY
+#include <linux/mount.h>
+#endif
+
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+#include "cgroup.h"
 #include "config.h"
 #include "dbg.h"
+#include "deadline.h"
+#include "fault.h"
 #include "loopback.h"
+#include "metrics.h"
+#include "placement.h"
+#include "protect_exec.h"
+#include "sandbox.h"
+#include "session.h"
+#include "teardown.h"
 
 static int protect_exec_clone(void *data);
 static bool valid_mntent(struct mntent *me);
+static bool same_root(int fd, int mnt_fd);
 static int pivot_root(const char *new_root, const char *put_old);
-static int protect_exec_validate_input(uid_t uid,
-                                       const char *fs_path,
-                                       const char *mnt_path,
-                                       const char *cgroup_path,
-                                       const char *exec_path,
-                                       char *const argv[],
-                                       char *const envp[]);
-
-struct protect_exec_args {
-	uid_t uid;
-	const char *fs_path;
-	const char *mnt_path;
-	const char *cgroup_path;
-	const char *exec_path;
-	char *const *argv;
-	char *const *envp;
-};
+static int lock_down_mounts(void);
+static int install_stdio_fds(const int stdio_fds[3]);
+
+#ifdef PROTECT_EXEC_FAULT_INJECTION
+int protect_exec_fault_step = 0;
+#endif
 
 // Description:
 //   Execute a program contained within a SquashFS image in a secure manner
@@ -61,39 +73,266 @@ struct protect_exec_args {
 int protect_exec(uid_t uid, const char *fs_path, const char *mnt_path,
                  const char *cgroup_path, const char *exec_path,
                  char *const argv[], char *const envp[])
+{
+	struct protect_exec_opts opts;
+	struct protect_exec_result result;
+
+	protect_exec_opts_init(&opts);
+	opts.uid = uid;
+	opts.fs_path = fs_path;
+	opts.mnt_path = mnt_path;
+	opts.cgroup_path = cgroup_path;
+	opts.exec_path = exec_path;
+	opts.argv = argv;
+	opts.envp = envp;
+
+	int ret = protect_exec_ex(&opts, &result);
+
+	// Callers of protect_exec(3) predate deferred teardown and may remove
+	// mnt_path as soon as it returns
+	teardown_wait_path(mnt_path);
+
+	if(ret)
+	{
+		return -1;
+	}
+
+	if(result.status != 0)
+	{
+		debug("protect_exec(3) failed. clone(2) and waitpid(2) calls completed with non-success status code. (status: %d)", WEXITSTATUS(result.status));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Reset a set of launch parameters to their defaults: all pointers NULL,
+//   UID 0 (rejected by protect_exec_ex(3) until set) and inherited stdio.
+void protect_exec_opts_init(struct protect_exec_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->stdio_fds[0] = -1;
+	opts->stdio_fds[1] = -1;
+	opts->stdio_fds[2] = -1;
+}
+
+// Description:
+//   Same as protect_exec(3), but takes its parameters as a struct and reports
+//   the wait status of the contained program instead of folding it into the
+//   return value.
+// Parameters:
+//   opts - Launch parameters, initialized with protect_exec_opts_init(3).
+//   result - Receives the outcome of the launch. May be NULL.
+// Returns:
+//   0 if the contained program was launched and reaped, -1 if the sandbox
+//   could not be set up.
+int protect_exec_ex(const struct protect_exec_opts *opts,
+                    struct protect_exec_result *result)
 {
 	int ret = -1;
-	int loop_fd;
+
+	// Step in progress, reported to the metrics segment on failure
+	int step = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	metrics_count_launch();
 
 	// 0. Trivial input validation
 	// Diallowed inputs:
 	//   1. NULL pointers
 	//   2. UID of 0 (corresponding with root)
-	if(protect_exec_validate_input(uid, fs_path, mnt_path, cgroup_path,
-				exec_path, argv, envp))
+	if(protect_exec_validate_input(opts, true))
 	{
 		debug("protect_exec(3) failed. Input validation failed. (errno: %s)", clean_errno());
 		goto error_0;
 	}
 
+	// 0b - 2. Place the sandbox and mount its root
+	struct sandbox sandbox;
+
+	if(sandbox_prepare(opts, &sandbox, &step))
+	{
+		goto error_0;
+	}
+
+	// 3. Perform `clone(2)`, detaching from certain namespaces
+	step = 3;
+
+	// 3a. Prepare to enforce the wall-clock and CPU time limits, if any
+	struct deadline deadline;
+
+	if(deadline_prepare(opts, sandbox.cgroup_path, &deadline))
+	{
+		debug("protect_exec(3) failed. Time limits could not be set up. (errno: %s)", clean_errno());
+		goto error_1;
+	}
+
+	// 3b. Call `clone(2)` synchronously. A time-limited sandbox is watched
+	//     through a pidfd, which cannot refer to a recycled PID.
+	struct protect_exec_args args;
+	args.opts = opts;
+	args.cgroup_path = sandbox.cgroup_path;
+	args.placement = &sandbox.placement;
+	args.deadline = &deadline;
+	args.start = &start;
+	args.mnt_fd = sandbox.mnt_fd;
+	args.session_sock = -1;
+
+	int status = 0;
+	pid_t clone_pid = sandbox_clone(&args, CLONE_VFORK | (deadline.armed ? CLONE_PIDFD : 0), &deadline.pidfd);
+
+	if(clone_pid == -1)
+	{
+		goto error_2;
+	}
+
+	metrics_add_sandboxes(1);
+
+	// 3c. Wait for the program to exit, killing the sandbox if it runs out of
+	//     time, then reap it
+	int deadline_exceeded;
+	int deadline_failed = deadline_wait(&deadline, clone_pid, &deadline_exceeded);
+	pid_t waited_pid = waitpid(clone_pid, &status, 0);
+
+	metrics_add_sandboxes(-1);
+
+	if(waited_pid == -1)
+	{
+		debug("protect_exec(3) failed. waitpid(2) call failed. (errno: %s)", clean_errno());
+		debug("waitpid(%d, %p, 0)", clone_pid, &status);
+		debug("*(%p) = %d", &status, status);
+		goto error_2;
+	}
+	else
+	{
+		debug("waitpid(2) completed.");
+	}
+
+	if(deadline_failed)
+	{
+		debug("protect_exec(3) failed. Time limits could not be enforced. (errno: %s)", clean_errno());
+		goto error_2;
+	}
+
+	if(result != NULL)
+	{
+		result->status = status;
+		result->deadline_exceeded = deadline_exceeded;
+	}
+
+	metrics_count_deadline(deadline_exceeded);
+
+	ret = 0;
+
+error_2:
+	deadline_release(&deadline);
+error_1:
+	sandbox_release(&sandbox);
+error_0:
+	if(ret)
+	{
+		metrics_count_failure(step);
+	}
+
+	return ret;
+}
+
+// Description:
+//   Steps 0b through 2: resolve and apply placement, link a loopback device
+//   to the image and mount it, with its fstab entries, at 'mnt_path'.
+//   Everything acquired is given back on failure.
+// Parameters:
+//   step - Set to the step in progress, for failure metrics.
+// Returns:
+//   0 on success, -1 on failure.
+int sandbox_prepare(const struct protect_exec_opts *opts,
+                    struct sandbox *sandbox, int *step)
+{
+	const char *mnt_path = opts->mnt_path;
+
+	sandbox->mnt_fd = -1;
+
+	// 0b. Resolve CPU and memory node placement and confine the sandbox
+	//     cgroup to it. A placed or time-limited sandbox gets a leaf cgroup
+	//     of its own, so that its cpuset, CPU usage and cgroup.kill are not
+	//     those of every launch sharing 'cgroup_path'.
+	if(placement_resolve(opts, &sandbox->placement))
+	{
+		debug("protect_exec(3) failed. Placement could not be resolved. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	sandbox->cgroup_leaf = false;
+	snprintf(sandbox->cgroup_path, sizeof(sandbox->cgroup_path), "%s", opts->cgroup_path);
+
+	if(sandbox->placement.cpus_set || sandbox->placement.mems_set ||
+	   opts->wall_timeout_ms || opts->cpu_timeout_ms)
+	{
+		if(cgroup_leaf_create(opts->cgroup_path, sandbox->cgroup_path, sizeof(sandbox->cgroup_path)))
+		{
+			debug("protect_exec(3) failed. Leaf cgroup could not be created. (errno: %s)", clean_errno());
+			goto error_0;
+		}
+
+		sandbox->cgroup_leaf = true;
+	}
+
+	if(placement_apply_cgroup(sandbox->cgroup_path, &sandbox->placement))
+	{
+		debug("protect_exec(3) failed. Placement could not be applied to the cgroup. (errno: %s)", clean_errno());
+		goto error_0;
+	}
+
 	// 1. Link a loopback device to the SquashFS file
-	char *loop_path = loopback_setup(fs_path);
+	*step = 1;
+	sandbox->loop_path = fault_inject(1) ? NULL : loopback_setup(opts->fs_path, &sandbox->loop_fd);
 
-	if(loop_path == NULL)
+	if(sandbox->loop_path == NULL)
 	{
 		debug("protect_exec(3) failed. Loopback device assignment failed. (errno: %s)", clean_errno());
 		goto error_0;
 	}
 
 	// 2. Mount that loopback device at /, tmpfs at /db, and all automatic `/etc/fstab` entries (relative to root path)
-	// 2a. Mount SquashFS loopback device
-	if(mount(loop_path, mnt_path, "squashfs", MS_RDONLY, NULL))
+	// 2a. Mount SquashFS loopback device, once any previous root at mnt_path
+	//     has been detached. Detaching it would take this one along.
+	//     The image is visible on the host for as long as the sandbox runs, so
+	//     its setuid binaries and device nodes must not work there.
+	*step = 2;
+	teardown_wait_path(mnt_path);
+
+	if(fault_inject(2) || mount(sandbox->loop_path, mnt_path, "squashfs", MS_RDONLY|MS_NOSUID|MS_NODEV, NULL))
 	{
 		debug("protect_exec(3) failed. mount(2) failed. (errno: %s)", clean_errno());
-		debug("mount(\"%s\", \"%s\", \"squashfs\", MS_RDONLY, NULL)", loop_path, mnt_path);
+		debug("mount(\"%s\", \"%s\", \"squashfs\", MS_RDONLY|MS_NOSUID|MS_NODEV, NULL)", sandbox->loop_path, mnt_path);
 		goto error_1;
 	}
 
+	// Keep hold of this exact mount, so that teardown detaches it rather than
+	// whatever mnt_path refers to by then
+	sandbox->mnt_fd = open(mnt_path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+
+	if(sandbox->mnt_fd == -1)
+	{
+		debug("protect_exec(3) failed. open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_PATH|O_DIRECTORY|O_CLOEXEC)", mnt_path);
+		goto error_2;
+	}
+
+	// Make the root mount private before anything is mounted below it, so
+	// that '/etc/fstab' entries and their unmounting are not copied to every
+	// peer of a shared mnt_path. Unmounting the root itself still reaches
+	// the copies made when it was mounted.
+	if(mount(NULL, mnt_path, NULL, MS_PRIVATE, NULL))
+	{
+		debug("protect_exec(3) failed. mount(2) failed. (errno: %s)", clean_errno());
+		debug("mount(NULL, \"%s\", NULL, MS_PRIVATE, NULL)", mnt_path);
+		close(sandbox->mnt_fd);
+		sandbox->mnt_fd = -1;
+		goto error_2;
+	}
+
 	// 2b. Mount contents of /etc/fstab if it exists
 	char fstab_path[4097];
 	snprintf(fstab_path, sizeof(fstab_path), "%s/etc/fstab", mnt_path);
@@ -123,7 +362,7 @@ int protect_exec(uid_t uid, const char *fs_path, const char *mnt_path,
 			snprintf(mnt_dir, sizeof(mnt_dir), "%s%s", mnt_path, me->mnt_dir);
 
 			// Mount valid fstab entry
-			if(mount(me->mnt_fsname, mnt_dir, me->mnt_type, 0, NULL))
+			if(mount(me->mnt_fsname, mnt_dir, me->mnt_type, MS_NOSUID|MS_NODEV, NULL))
 			{
 				// '/etc/fstab' mount failure is not considered fatal
 				debug("mount(2) failed while processing '/etc/fstab'. (errno: %s)", clean_errno());
@@ -134,8 +373,38 @@ int protect_exec(uid_t uid, const char *fs_path, const char *mnt_path,
 		endmntent(me_file);
 	}
 
-	// 3. Perform `clone(2)`, detaching from certain namespaces
-	// 3a. Allocate several pages for the `clone(2)` stack.
+	return 0;
+
+error_2:
+	if(umount2(mnt_path, MNT_DETACH))
+	{
+		debug("umount2(2) failed. (errno: %s)", clean_errno());
+		debug("umount2(\"%s\", MNT_DETACH)", mnt_path);
+	}
+error_1:
+	teardown_defer(-1, sandbox->loop_fd);
+	free(sandbox->loop_path);
+error_0:
+	if(sandbox->cgroup_leaf)
+	{
+		cgroup_leaf_remove(sandbox->cgroup_path);
+	}
+
+	placement_release(&sandbox->placement);
+	return -1;
+}
+
+// Description:
+//   Clone the sandbox child, which performs steps 4 onwards in new
+//   namespaces.
+// Parameters:
+//   flags - Added to CLONE_NAMESPACES and SIGCHLD.
+//   pidfd - Receives a pidfd for the child if 'flags' has CLONE_PIDFD.
+// Returns:
+//   PID of the child, or -1 on failure.
+pid_t sandbox_clone(struct protect_exec_args *args, int flags, int *pidfd)
+{
+	// Allocate several pages for the `clone(2)` stack.
 	size_t clone_stack_size = CLONE_STACK_SIZE;
 	long page_size = sysconf(_SC_PAGESIZE);
 
@@ -156,103 +425,81 @@ int protect_exec(uid_t uid, const char *fs_path, const char *mnt_path,
 
 	char *clone_stack = alloca(clone_stack_size);
 
-	// 3b. Store the arguments to pass to `clone(2)` in a dynamically allocated struct
-	struct protect_exec_args args;
-	args.uid = uid;
-	args.fs_path = fs_path;
-	args.mnt_path = mnt_path;
-	args.cgroup_path = cgroup_path;
-	args.exec_path = exec_path;
-	args.argv = argv;
-	args.envp = envp;
-
-	// 3c. Call `clone(2)` synchronously
-	int status = 0;
-	pid_t clone_pid = clone(protect_exec_clone, clone_stack + clone_stack_size,
-			CLONE_NAMESPACES | CLONE_VFORK | SIGCHLD, &args);
+	flags |= CLONE_NAMESPACES | SIGCHLD;
+	pid_t clone_pid = fault_inject(3) ? -1 : clone(protect_exec_clone, clone_stack + clone_stack_size,
+			flags, args, pidfd);
 
 	if(clone_pid == -1)
 	{
 		debug("protect_exec(3) failed. clone(2) call failed. (errno: %s)", clean_errno());
-		debug("clone(%p, %p, CLONE_NAMESPACES | CLONE_VFORK | SIGCHLD, %p)",
-			protect_exec_clone, clone_stack + clone_stack_size, &args);
-		goto error_2;
+		debug("clone(%p, %p, %#x, %p, %p)",
+			protect_exec_clone, clone_stack + clone_stack_size, flags, (void *) args, (void *) pidfd);
+		return -1;
 	}
 
 	debug("clone(2) completed.");
 
-	if(waitpid(clone_pid, &status, 0) == -1)
-	{
-		debug("protect_exec(3) failed. waitpid(2) call failed. (errno: %s)", clean_errno());
-		debug("waitpid(%d, %p, 0)", clone_pid, &status);
-		debug("*(%p) = %d", &status, status);
-		goto error_2;
-	}
-	else
-	{
-		debug("waitpid(2) completed.");
-
-		if(status != 0)
-		{
-			debug("protect_exec(3) failed. clone(2) and waitpid(2) calls completed with non-success status code. (status: %d)", WEXITSTATUS(status));
-			goto error_2;
-		}
-	}
-
-	ret = 0;
-
-error_2:
-	if(umount2(mnt_path, MNT_DETACH))
-	{
-		debug("umount2(2) failed. (errno: %s)", clean_errno());
-		debug("umount2(\"%s\", MNT_DETACH)", mnt_path);
-	}
-error_1:
-	loop_fd = open(loop_path, O_NONBLOCK);
-
-	if(loop_fd == -1)
-	{
-		debug("open(2) failed. (errno: %s)", clean_errno());
-		debug("open(\"%s\", O_NONBLOCK)", loop_path);
-	}
+	return clone_pid;
+}
 
-	if(ioctl(loop_fd, LOOP_CLR_FD))
-	{
-		debug("ioctl(2) failed. (errno: %s)", clean_errno());
-		debug("ioctl(%d, LOOP_CLR_FD)", loop_fd);
-	}
+// Description:
+//   Unmount a sandbox root and release its loopback device, off the
+//   caller's latency path unless DEFERRED_TEARDOWN is disabled, and give
+//   back its placement and leaf cgroup. Every process of the sandbox must
+//   have been reaped.
+void sandbox_release(struct sandbox *sandbox)
+{
+	teardown_defer(sandbox->mnt_fd, sandbox->loop_fd);
+	free(sandbox->loop_path);
 
-	if(close(loop_fd))
+	if(sandbox->cgroup_leaf)
 	{
-		debug("close(2) failed. (errno: %s)", clean_errno());
-		debug("close(%d)", loop_fd);
+		cgroup_leaf_remove(sandbox->cgroup_path);
 	}
 
-	free(loop_path);
-error_0:
-	return ret;
+	placement_release(&sandbox->placement);
 }
 
+// Description:
+//   Body of the cloned child: steps 4 through 8. Every descriptor opened here
+//   is closed as soon as its step is done, or on failure.
+// Returns:
+//   Only on failure, with -1.
 static int protect_exec_clone(void *data)
 {
-	struct protect_exec_args *args = data;
+	const struct protect_exec_args *args = data;
+	const struct protect_exec_opts *opts = args->opts;
+	int ret = -1;
+	int cgroup_tasks_fd = -1;
+	int old_root_fd = -1;
+	int new_root_fd = -1;
+	int step = 4;
 
 	// 4. Join the specified cgroup
 	// 4a. Acquire a file descriptor to the cgroups 'tasks' file
-	int cgroup_dir_fd = open(args->cgroup_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	int cgroup_dir_fd = fault_inject(4) ? -1 : open(args->cgroup_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
 	if(cgroup_dir_fd == -1)
 	{
 		debug("open(2) failed. (errno: %s)", clean_errno());
 		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", args->cgroup_path);
-		return -1;
+		goto error;
+	}
+
+	// cgroup v2 has no 'tasks' file; 'cgroup.procs' takes the process instead
+	const char *cgroup_tasks_name = "tasks";
+	cgroup_tasks_fd = openat(cgroup_dir_fd, cgroup_tasks_name, O_WRONLY|O_CLOEXEC);
+
+	if(cgroup_tasks_fd == -1 && errno == ENOENT)
+	{
+		cgroup_tasks_name = "cgroup.procs";
+		cgroup_tasks_fd = openat(cgroup_dir_fd, cgroup_tasks_name, O_WRONLY|O_CLOEXEC);
 	}
 
-	int cgroup_tasks_fd = openat(cgroup_dir_fd, "tasks", O_WRONLY|O_CLOEXEC);
 	if(cgroup_tasks_fd == -1)
 	{
 		debug("openat(2) failed. (errno: %s)", clean_errno());
-		debug("openat(%d, \"tasks\", O_WRONLY|O_CLOEXEC)", cgroup_dir_fd);
-		return -1;
+		debug("openat(%d, \"%s\", O_WRONLY|O_CLOEXEC)", cgroup_dir_fd, cgroup_tasks_name);
+		goto error;
 	}
 
 	// 4b. Convert the current process' pid into a string
@@ -261,88 +508,220 @@ static int protect_exec_clone(void *data)
 
 	// 4c. Write the current process' pid to the tasks file
 	size_t pid_string_size = strnlen(pid_string, 10);
-	int ret = write(cgroup_tasks_fd, pid_string, pid_string_size);
+	ssize_t written = write(cgroup_tasks_fd, pid_string, pid_string_size);
 
-	if((size_t) ret != pid_string_size)
+	if((size_t) written != pid_string_size)
 	{
 		debug("write(2) failed. (errno: %s)", clean_errno());
 		debug("write(%d, \"%s\", %lu)", cgroup_tasks_fd, pid_string, pid_string_size);
-		return -1;
+		goto error;
+	}
+
+	close(cgroup_tasks_fd);
+	close(cgroup_dir_fd);
+	cgroup_tasks_fd = cgroup_dir_fd = -1;
+
+	// 4d. Pin the current process to the placement CPUs
+	if(placement_apply_affinity(args->placement))
+	{
+		goto error;
 	}
 
 	// 5. `pivot_root(2)`'s into the new root, overlaying the old root onto the new root
-	// 5a. Acquire file descriptors for both the old and the new root
-	int old_root_fd = open("/", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	// 5a. Make every mount of the new namespace private. Its copies of shared
+	//     host mounts would otherwise stay peers of the originals, so that
+	//     every host mount and unmount is repeated in every live sandbox, and
+	//     `pivot_root(2)` refuses a new root below a shared mount.
+	step = 5;
+
+	if(mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL))
+	{
+		debug("mount(2) failed. (errno: %s)", clean_errno());
+		debug("mount(NULL, \"/\", NULL, MS_REC|MS_PRIVATE, NULL)");
+		goto error;
+	}
+
+	// 5b. Acquire file descriptors for both the old and the new root
+	old_root_fd = open("/", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
 	if(old_root_fd == -1)
 	{
 		debug("open(2) failed. (errno: %s)", clean_errno());
 		debug("open(\"/\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)");
-		return -1;
+		goto error;
 	}
 
-	int new_root_fd = open(args->mnt_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	//     'mnt_fd' refers to the root as mounted in the caller's namespace,
+	//     where `pivot_root(2)` cannot take it, so the root is reopened by
+	//     path in this one. Whatever the path shows must be that same root,
+	//     not something moved or mounted there since step 2.
+	new_root_fd = open(opts->mnt_path, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
 	if(new_root_fd == -1)
 	{
 		debug("open(2) failed. (errno: %s)", clean_errno());
-		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", args->mnt_path);
-		return -1;
+		debug("open(\"%s\", O_DIRECTORY|O_RDONLY|O_CLOEXEC)", opts->mnt_path);
+		goto error;
 	}
 
-	// 5b. Perform `pivot_root(2)`
+	if(!same_root(new_root_fd, args->mnt_fd))
+	{
+		debug("Mount path no longer shows the sandbox root. (mnt_path: \"%s\")", opts->mnt_path);
+		errno = ESTALE;
+		goto error;
+	}
+
+	// 5c. Perform `pivot_root(2)`
 	if(fchdir(new_root_fd))
 	{
 		debug("fchdir(2) failed. (errno: %s)", clean_errno());
 		debug("fchdir(%d)", new_root_fd);
-		return -1;
+		goto error;
 	}
 
-	if(pivot_root(".", "."))
+	if(fault_inject(5) || pivot_root(".", "."))
 	{
 		debug("pivot_root(2) failed. (errno: %s)", clean_errno());
 		debug("pivot_root(\".\", \".\")");
-		return -1;
+		goto error;
 	}
 
-	// 5c. Unmount the old root
+	// 5d. Unmount the old root
 	if(fchdir(old_root_fd))
 	{
 		debug("fchdir(2) failed. (errno: %s)", clean_errno());
 		debug("fchdir(%d)", old_root_fd);
-		return -1;
+		goto error;
 	}
 
 	if(umount2(".", MNT_DETACH))
 	{
 		debug("umount2(2) failed. (errno: %s)", clean_errno());
 		debug("umount2(\".\", MNT_DETACH)");
-		return -1;
+		goto error;
 	}
 
-	// 5d. Change current working directory to the new root
+	// 5e. Change current working directory to the new root
 	if(fchdir(new_root_fd))
 	{
 		debug("fchdir(2) failed. (errno: %s)", clean_errno());
 		debug("fchdir(%d)", new_root_fd);
+		goto error;
+	}
+
+	close(new_root_fd);
+	close(old_root_fd);
+	new_root_fd = old_root_fd = -1;
+
+	// 6. Lock down every mount of the new root with SANDBOX_MOUNT_ATTR. The
+	//    network namespace is left with its loopback interface down.
+	step = 6;
+
+	if(fault_inject(6) || lock_down_mounts())
+	{
+		debug("Namespace configuration failed. (errno: %s)", clean_errno());
+		goto error;
+	}
+
+	// 7. A session stub installs the stdio descriptors its commands inherit
+	//    and stays behind as root to serve them. Otherwise, go on to the
+	//    program itself.
+	if(args->session_sock != -1)
+	{
+		step = 7;
+
+		if(install_stdio_fds(opts->stdio_fds))
+		{
+			goto error;
+		}
+
+		return session_serve(args->session_sock, opts->uid);
+	}
+
+	sandbox_exec(opts, opts->uid, args->deadline, args->start, &step);
+
+error:
+	// The metrics segment is shared with the parent, which cannot tell which
+	// of these steps failed
+	metrics_count_failure(step);
+
+	if(new_root_fd != -1)
+	{
+		close(new_root_fd);
+	}
+
+	if(old_root_fd != -1)
+	{
+		close(old_root_fd);
+	}
+
+	if(cgroup_tasks_fd != -1)
+	{
+		close(cgroup_tasks_fd);
+	}
+
+	if(cgroup_dir_fd != -1)
+	{
+		close(cgroup_dir_fd);
+	}
+
+	return ret;
+}
+
+// Description:
+//   Steps 7 and 8: install the requested stdio descriptors, limit CPU time
+//   if the cgroup cannot, drop supplementary groups, set every UID and GID to
+//   'uid' and `execve(2)` the program.
+// Parameters:
+//   deadline - Time limits of the launch, or NULL for none.
+//   start - Start of the launch, to record its setup latency, or NULL.
+//   step - Set to the step in progress, for failure metrics.
+// Returns:
+//   Only on failure, with -1.
+int sandbox_exec(const struct protect_exec_opts *opts, uid_t uid,
+                 const struct deadline *deadline,
+                 const struct timespec *start, int *step)
+{
+	*step = 7;
+
+	if(install_stdio_fds(opts->stdio_fds))
+	{
 		return -1;
 	}
 
-	// 6. Change the namespaces to their desired configuration (e.g. unmount everything not from step 2, remove all interfaces)
-	// TODO: Figure out what to change and how to change it.
+	if(deadline != NULL && deadline_apply_rlimit(deadline))
+	{
+		return -1;
+	}
 
-	// 7. Perform `setuid(2)` with the specified UID
-	if(setuid(args->uid))
+	// The C library's set-ID wrappers signal every thread it knows of and
+	// wait for each to follow, but a clone(2) of a multi-threaded caller has
+	// none of them and would wait forever. The system calls act on this
+	// thread alone, which is all there is.
+	if(fault_inject(7) ||
+	   syscall(__NR_setgroups, 0, NULL) ||
+	   syscall(__NR_setresgid, (gid_t) uid, (gid_t) uid, (gid_t) uid) ||
+	   syscall(__NR_setresuid, uid, uid, uid))
 	{
-		debug("setuid(2) failed. (errno: %s)", clean_errno());
-		debug("setuid(%d)", args->uid);
+		debug("Dropping privileges failed. (errno: %s)", clean_errno());
+		debug("setresuid(%d, %d, %d)", uid, uid, uid);
 		return -1;
 	}
 
 	// 8. `execve(2)` the specified program
-	execve(args->exec_path, args->argv, args->envp);
+	*step = 8;
+
+	if(start != NULL)
+	{
+		metrics_observe_setup(start);
+	}
+
+	if(!fault_inject(8))
+	{
+		execve(opts->exec_path, opts->argv, opts->envp);
+	}
 
 	// NOTE: The following is only reached upon the failure of `execve(2)`
 	debug("execve(2) failed. (errno: %s)", clean_errno());
-	debug("execve(\"%s\", %p, %p)", args->exec_path, args->argv, args->envp);
+	debug("execve(\"%s\", %p, %p)", opts->exec_path, (void *) opts->argv, (void *) opts->envp);
 
 	return -1;
 }
@@ -357,25 +736,121 @@ static bool valid_mntent(struct mntent *me)
 	return valid_mnt_type;
 }
 
+// Returns:
+//   Whether 'fd' refers to the same directory as the O_PATH descriptor
+//   'mnt_fd'. Every sandbox root has a loopback device, and so a device
+//   number, of its own.
+static bool same_root(int fd, int mnt_fd)
+{
+	struct stat fd_st;
+	struct stat mnt_st;
+
+	if(fstat(fd, &fd_st) || fstat(mnt_fd, &mnt_st))
+	{
+		debug("fstat(2) failed. (errno: %s)", clean_errno());
+		return false;
+	}
+
+	return fd_st.st_dev == mnt_st.st_dev && fd_st.st_ino == mnt_st.st_ino;
+}
+
 static int pivot_root(const char *new_root, const char *put_old)
 {
 	return syscall(__NR_pivot_root, new_root, put_old);
 }
 
+// Description:
+//   Apply SANDBOX_MOUNT_ATTR to the root and every mount below it in one
+//   `mount_setattr(2)` call, and make them all private. Kernels before 5.12
+//   only get the root itself remounted. The system call is made directly,
+//   as glibc only wraps it from 2.36.
+// Returns:
+//   0 on success, -1 on failure.
+static int lock_down_mounts(void)
+{
+	struct mount_attr attr = { .attr_set = SANDBOX_MOUNT_ATTR, .propagation = MS_PRIVATE };
+
+	if(syscall(__NR_mount_setattr, AT_FDCWD, "/", AT_RECURSIVE, &attr, sizeof(attr)) == 0)
+	{
+		return 0;
+	}
+
+	if(errno != ENOSYS)
+	{
+		debug("mount_setattr(2) failed. (errno: %s)", clean_errno());
+		debug("mount_setattr(AT_FDCWD, \"/\", AT_RECURSIVE, {%#llx, 0, MS_PRIVATE, 0}, %zu)",
+			(unsigned long long) attr.attr_set, sizeof(attr));
+		return -1;
+	}
+
+	unsigned long flags = MS_REMOUNT|MS_BIND;
+	flags |= (SANDBOX_MOUNT_ATTR & MOUNT_ATTR_RDONLY) ? MS_RDONLY : 0;
+	flags |= (SANDBOX_MOUNT_ATTR & MOUNT_ATTR_NOSUID) ? MS_NOSUID : 0;
+	flags |= (SANDBOX_MOUNT_ATTR & MOUNT_ATTR_NODEV) ? MS_NODEV : 0;
+	flags |= (SANDBOX_MOUNT_ATTR & MOUNT_ATTR_NOEXEC) ? MS_NOEXEC : 0;
+
+	debug("mount_setattr(2) is not supported. Locking down the root mount only.");
+
+	if(mount(NULL, "/", NULL, flags, NULL))
+	{
+		debug("mount(2) failed. (errno: %s)", clean_errno());
+		debug("mount(NULL, \"/\", NULL, %#lx, NULL)", flags);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Install the given descriptors as stdin, stdout and stderr of the current
+//   process. Negative entries leave the inherited descriptor in place.
+// Returns:
+//   0 on success, -1 on failure.
+static int install_stdio_fds(const int stdio_fds[3])
+{
+	for(int i = 0; i < 3; i++)
+	{
+		if(stdio_fds[i] < 0 || stdio_fds[i] == i)
+		{
+			continue;
+		}
+
+		if(dup2(stdio_fds[i], i) == -1)
+		{
+			debug("dup2(2) failed. (errno: %s)", clean_errno());
+			debug("dup2(%d, %d)", stdio_fds[i], i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 // TODO Wishlist:
 //   1. Perform SquashFS magic number check and using (dynamically loaded)
 //      libmagic(3), print a description of the file type when debugging, if
 //      libmagic is found.
-static int protect_exec_validate_input(uid_t uid,
-                                       const char *fs_path,
-                                       const char *mnt_path,
-                                       const char *cgroup_path,
-                                       const char *exec_path,
-                                       char *const argv[],
-                                       char *const envp[])
+// Parameters:
+//   need_exec - Whether 'exec_path', 'argv' and 'envp' are required. A
+//               session takes them per command instead.
+int protect_exec_validate_input(const struct protect_exec_opts *opts, bool need_exec)
 {
 	errno = EINVAL;
 
+	if(opts == NULL)
+	{
+		debug("protect_exec(3) input is invalid. 'opts' cannot be NULL. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	uid_t uid = opts->uid;
+	const char *fs_path = opts->fs_path;
+	const char *mnt_path = opts->mnt_path;
+	const char *cgroup_path = opts->cgroup_path;
+	const char *exec_path = opts->exec_path;
+	char *const *argv = opts->argv;
+	char *const *envp = opts->envp;
+
 	if(uid == 0)
 	{
 		debug("protect_exec(3) input is invalid. 'uid' cannot be 0. (errno: %s)", clean_errno());
@@ -396,23 +871,23 @@ static int protect_exec_validate_input(uid_t uid,
 		debug("protect_exec(3) input is invalid. 'cgroup_path' cannot be NULL. (errno: %s)", clean_errno());
 	}
 
-	if(exec_path == NULL)
+	if(need_exec && exec_path == NULL)
 	{
 		debug("protect_exec(3) input is invalid. 'exec_path' cannot be NULL. (errno: %s)", clean_errno());
 	}
 
-	if(argv == NULL)
+	if(need_exec && argv == NULL)
 	{
 		debug("protect_exec(3) input is invalid. 'argv' cannot be NULL. (errno: %s)", clean_errno());
 	}
 
-	if(envp == NULL)
+	if(need_exec && envp == NULL)
 	{
 		debug("protect_exec(3) input is invalid. 'envp' cannot be NULL. (errno: %s)", clean_errno());
 	}
 
 	if(uid == 0 || fs_path == NULL || mnt_path == NULL || cgroup_path == NULL ||
-			exec_path == NULL || argv == NULL || envp == NULL)
+			(need_exec && (exec_path == NULL || argv == NULL || envp == NULL)))
 	{
 		return -1;
 	}
@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "proto.h"
+
+static int recv_request(int sock, struct pexec_proto_request *req,
+                        char *buf, char **vec, size_t vec_size);
+static size_t vec_len(char *const *vec);
+static char *pack_string(char *dst, const char *src);
+static const char *unpack_string(const char **cursor, const char *end);
+static int fd_count(uint32_t fd_mask);
+
+// Description:
+//   Encode a launch request and send it, together with its stdio and cgroup
+//   descriptors, as a single SOCK_SEQPACKET message.
+// Parameters:
+//   sock - Connected SOCK_SEQPACKET socket.
+//   opts - Launch parameters. Non-negative 'stdio_fds' entries are passed to
+//          the peer through SCM_RIGHTS.
+//   cgroup_fd - Directory descriptor of the cgroup to join, or -1 to have the
+//               peer resolve 'opts->cgroup_path' itself.
+// Returns:
+//   0 on success, -1 on failure.
+int pexec_proto_send_request(int sock, const struct protect_exec_opts *opts,
+                             int cgroup_fd)
+{
+	const char *paths[4] = {
+		opts->fs_path, opts->mnt_path,
+		opts->cgroup_path != NULL ? opts->cgroup_path : "",
+		opts->exec_path
+	};
+	size_t argc = vec_len(opts->argv);
+	size_t envc = vec_len(opts->envp);
+	size_t size = sizeof(struct pexec_proto_request_hdr);
+
+	for(int i = 0; i < 4; i++)
+	{
+		size += strlen(paths[i]) + 1;
+	}
+
+	for(size_t i = 0; i < argc; i++)
+	{
+		size += strlen(opts->argv[i]) + 1;
+	}
+
+	for(size_t i = 0; i < envc; i++)
+	{
+		size += strlen(opts->envp[i]) + 1;
+	}
+
+	if(size > PEXEC_PROTO_MAX_MSG)
+	{
+		debug("Launch request exceeds PEXEC_PROTO_MAX_MSG. (size: %zu)", size);
+		errno = E2BIG;
+		return -1;
+	}
+
+	char *buf = malloc(size);
+
+	if(buf == NULL)
+	{
+		debug("malloc(3) failed. (errno: %s)", clean_errno());
+		debug("malloc(%zu)", size);
+		return -1;
+	}
+
+	// Attach descriptors in PEXEC_PROTO_FD_* bit order
+	int fds[PEXEC_PROTO_MAX_FDS];
+	int nfds = 0;
+	uint32_t fd_mask = 0;
+
+	for(int i = 0; i < 3; i++)
+	{
+		if(opts->stdio_fds[i] >= 0)
+		{
+			fd_mask |= 1u << i;
+			fds[nfds++] = opts->stdio_fds[i];
+		}
+	}
+
+	if(cgroup_fd >= 0)
+	{
+		fd_mask |= PEXEC_PROTO_FD_CGROUP;
+		fds[nfds++] = cgroup_fd;
+	}
+
+	struct pexec_proto_request_hdr hdr = {
+		.magic = PEXEC_PROTO_MAGIC,
+		.version = PEXEC_PROTO_VERSION,
+		.uid = opts->uid,
+		.fd_mask = fd_mask,
+		.argc = argc,
+		.envc = envc,
+		.wall_timeout_ms = opts->wall_timeout_ms,
+		.cpu_timeout_ms = opts->cpu_timeout_ms,
+	};
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	char *cursor = buf + sizeof(hdr);
+
+	for(int i = 0; i < 4; i++)
+	{
+		cursor = pack_string(cursor, paths[i]);
+	}
+
+	for(size_t i = 0; i < argc; i++)
+	{
+		cursor = pack_string(cursor, opts->argv[i]);
+	}
+
+	for(size_t i = 0; i < envc; i++)
+	{
+		cursor = pack_string(cursor, opts->envp[i]);
+	}
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * PEXEC_PROTO_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if(nfds > 0)
+	{
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	free(buf);
+
+	if(sent != (ssize_t) size)
+	{
+		debug("sendmsg(2) failed. (errno: %s)", clean_errno());
+		debug("sendmsg(%d, %p, MSG_NOSIGNAL)", sock, (void *) &msg);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Receive and decode a launch request sent by pexec_proto_send_request().
+//   Received descriptors are close-on-exec; protect_exec_ex(3) installs the
+//   stdio ones in the contained program.
+// Returns:
+//   0 on success, -1 on failure. 'req' only needs to be released on success.
+int pexec_proto_recv_request(int sock, struct pexec_proto_request *req)
+{
+	char *buf = malloc(PEXEC_PROTO_MAX_MSG);
+
+	if(buf == NULL)
+	{
+		debug("malloc(3) failed. (errno: %s)", clean_errno());
+		debug("malloc(%d)", PEXEC_PROTO_MAX_MSG);
+		return -1;
+	}
+
+	if(recv_request(sock, req, buf, NULL, 0))
+	{
+		free(buf);
+		return -1;
+	}
+
+	req->buf = buf;
+
+	return 0;
+}
+
+// Description:
+//   Same as pexec_proto_recv_request(), but decodes into 'storage' instead
+//   of allocating, for a process that may not call malloc(3). The request
+//   is valid until 'storage' is reused.
+// Returns:
+//   0 on success, -1 on failure. 'req' only needs to be released on success.
+int pexec_proto_recv_request_into(int sock, struct pexec_proto_request *req,
+                                  struct pexec_proto_storage *storage)
+{
+	size_t vec_size = sizeof(storage->vec) / sizeof(storage->vec[0]);
+
+	return recv_request(sock, req, storage->buf, storage->vec, vec_size);
+}
+
+void pexec_proto_request_free(struct pexec_proto_request *req)
+{
+	for(int i = 0; i < 3; i++)
+	{
+		if(req->opts.stdio_fds[i] >= 0)
+		{
+			close(req->opts.stdio_fds[i]);
+		}
+	}
+
+	if(req->cgroup_fd >= 0)
+	{
+		close(req->cgroup_fd);
+	}
+
+	free(req->vec);
+	free(req->buf);
+}
+
+// Description:
+//   Send the outcome of a launch request back to the client.
+// Parameters:
+//   ret - Return value of protect_exec_ex(3).
+//   error - errno observed when 'ret' is -1.
+//   result - Outcome reported by protect_exec_ex(3). Ignored when 'ret' is -1.
+// Returns:
+//   0 on success, -1 on failure.
+int pexec_proto_send_response(int sock, int ret, int error,
+                              const struct protect_exec_result *result)
+{
+	struct pexec_proto_response resp = {
+		.magic = PEXEC_PROTO_MAGIC,
+		.ret = ret,
+		.error = ret ? error : 0,
+		.status = ret ? 0 : result->status,
+		.deadline_exceeded = ret ? 0 : result->deadline_exceeded,
+	};
+
+	if(send(sock, &resp, sizeof(resp), MSG_NOSIGNAL) != sizeof(resp))
+	{
+		debug("send(2) failed. (errno: %s)", clean_errno());
+		debug("send(%d, %p, %zu, MSG_NOSIGNAL)", sock, (void *) &resp, sizeof(resp));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Receive the outcome of a launch request.
+// Returns:
+//   The peer's protect_exec_ex(3) return value, with errno set to the peer's
+//   errno when it is -1. Also -1 if the response could not be received.
+int pexec_proto_recv_response(int sock, struct protect_exec_result *result)
+{
+	struct pexec_proto_response resp;
+	ssize_t size = recv(sock, &resp, sizeof(resp), 0);
+
+	if(size == -1)
+	{
+		debug("recv(2) failed. (errno: %s)", clean_errno());
+		debug("recv(%d, %p, %zu, 0)", sock, (void *) &resp, sizeof(resp));
+		return -1;
+	}
+
+	if(size != sizeof(resp) || resp.magic != PEXEC_PROTO_MAGIC)
+	{
+		debug("Launch response is invalid. (size: %zd)", size);
+		errno = EPROTO;
+		return -1;
+	}
+
+	if(resp.ret)
+	{
+		errno = resp.error;
+		return -1;
+	}
+
+	if(result != NULL)
+	{
+		result->status = resp.status;
+		result->deadline_exceeded = resp.deadline_exceeded;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Receive a request into 'buf', of PEXEC_PROTO_MAX_MSG bytes, and decode
+//   it. argv and envp go to 'vec', of 'vec_size' entries, or to 'req->vec',
+//   allocated here, if 'vec' is NULL.
+// Returns:
+//   0 on success, -1 on failure.
+static int recv_request(int sock, struct pexec_proto_request *req,
+                        char *buf, char **vec, size_t vec_size)
+{
+	memset(req, 0, sizeof(*req));
+	protect_exec_opts_init(&req->opts);
+	req->cgroup_fd = -1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * PEXEC_PROTO_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = PEXEC_PROTO_MAX_MSG };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+	if(size == -1)
+	{
+		debug("recvmsg(2) failed. (errno: %s)", clean_errno());
+		debug("recvmsg(%d, %p, MSG_CMSG_CLOEXEC)", sock, (void *) &msg);
+		return -1;
+	}
+
+	// Collect any descriptors first so that they are closed on every error
+	// path below.
+	int fds[PEXEC_PROTO_MAX_FDS];
+	int nfds = 0;
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		{
+			continue;
+		}
+
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *data = (int *) CMSG_DATA(cmsg);
+
+		for(int i = 0; i < n; i++)
+		{
+			if(nfds < PEXEC_PROTO_MAX_FDS)
+			{
+				fds[nfds++] = data[i];
+			}
+			else
+			{
+				close(data[i]);
+			}
+		}
+	}
+
+	struct pexec_proto_request_hdr hdr;
+
+	if((size_t) size < sizeof(hdr) || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+	{
+		debug("Launch request is truncated. (size: %zd)", size);
+		errno = EPROTO;
+		goto error_fds;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if(hdr.magic != PEXEC_PROTO_MAGIC || hdr.version != PEXEC_PROTO_VERSION ||
+	   fd_count(hdr.fd_mask) != nfds || hdr.fd_mask >> PEXEC_PROTO_MAX_FDS ||
+	   hdr.argc == 0 || hdr.argc > PEXEC_PROTO_MAX_MSG || hdr.envc > PEXEC_PROTO_MAX_MSG)
+	{
+		debug("Launch request header is invalid. (magic: %x, version: %u, fd_mask: %x, nfds: %d)",
+			hdr.magic, hdr.version, hdr.fd_mask, nfds);
+		errno = EPROTO;
+		goto error_fds;
+	}
+
+	size_t vec_used = (size_t) hdr.argc + hdr.envc + 2;
+
+	if(vec == NULL)
+	{
+		vec = req->vec = calloc(vec_used, sizeof(char *));
+
+		if(vec == NULL)
+		{
+			debug("calloc(3) failed. (errno: %s)", clean_errno());
+			goto error_fds;
+		}
+	}
+	else if(vec_used > vec_size)
+	{
+		debug("Launch request has too many strings. (argc: %u, envc: %u)", hdr.argc, hdr.envc);
+		errno = EPROTO;
+		goto error_fds;
+	}
+	else
+	{
+		memset(vec, 0, vec_used * sizeof(char *));
+	}
+
+	const char *cursor = buf + sizeof(hdr);
+	const char *end = buf + size;
+	const char *paths[4];
+	bool truncated = false;
+
+	for(int i = 0; i < 4; i++)
+	{
+		paths[i] = unpack_string(&cursor, end);
+		truncated |= paths[i] == NULL;
+	}
+
+	// argv and envp share 'vec', each followed by a NULL terminator
+	for(uint32_t i = 0; i < hdr.argc + hdr.envc && !truncated; i++)
+	{
+		size_t slot = i < hdr.argc ? i : i + 1;
+		vec[slot] = (char *) unpack_string(&cursor, end);
+		truncated |= vec[slot] == NULL;
+	}
+
+	if(truncated || cursor != end)
+	{
+		debug("Launch request strings do not match the header. (argc: %u, envc: %u)", hdr.argc, hdr.envc);
+		errno = EPROTO;
+		goto error_vec;
+	}
+
+	// Assign descriptors in PEXEC_PROTO_FD_* bit order
+	int fd_index = 0;
+
+	for(int i = 0; i < 3; i++)
+	{
+		if(hdr.fd_mask & (1u << i))
+		{
+			req->opts.stdio_fds[i] = fds[fd_index++];
+		}
+	}
+
+	req->opts.uid = hdr.uid;
+	req->opts.wall_timeout_ms = hdr.wall_timeout_ms;
+	req->opts.cpu_timeout_ms = hdr.cpu_timeout_ms;
+	req->opts.fs_path = paths[0];
+	req->opts.mnt_path = paths[1];
+	req->opts.cgroup_path = paths[2];
+	req->opts.exec_path = paths[3];
+	req->opts.argv = vec;
+	req->opts.envp = vec + hdr.argc + 1;
+
+	// A cgroup descriptor takes precedence over any path sent along with it
+	if(hdr.fd_mask & PEXEC_PROTO_FD_CGROUP)
+	{
+		req->cgroup_fd = fds[fd_index];
+		snprintf(req->cgroup_fd_path, sizeof(req->cgroup_fd_path), "/proc/self/fd/%d", req->cgroup_fd);
+		req->opts.cgroup_path = req->cgroup_fd_path;
+	}
+
+	return 0;
+
+error_vec:
+	free(req->vec);
+	req->vec = NULL;
+error_fds:
+	for(int i = 0; i < nfds; i++)
+	{
+		close(fds[i]);
+	}
+
+	return -1;
+}
+
+static size_t vec_len(char *const *vec)
+{
+	size_t len = 0;
+
+	while(vec[len] != NULL)
+	{
+		len++;
+	}
+
+	return len;
+}
+
+static char *pack_string(char *dst, const char *src)
+{
+	size_t len = strlen(src) + 1;
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+// Description:
+//   Return the NUL-terminated string at '*cursor' and advance past it.
+// Returns:
+//   NULL if no terminator is found before 'end'.
+static const char *unpack_string(const char **cursor, const char *end)
+{
+	const char *str = *cursor;
+
+	if(str == NULL || str >= end)
+	{
+		return NULL;
+	}
+
+	const char *nul = memchr(str, 0, end - str);
+
+	if(nul == NULL)
+	{
+		*cursor = NULL;
+		return NULL;
+	}
+
+	*cursor = nul + 1;
+	return str;
+}
+
+static int fd_count(uint32_t fd_mask)
+{
+	int count = 0;
+
+	for(int i = 0; i < PEXEC_PROTO_MAX_FDS; i++)
+	{
+		count += (fd_mask >> i) & 1;
+	}
+
+	return count;
+}
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "metrics.h"
+#include "protect_exec.h"
+#include "proto.h"
+#include "sandbox.h"
+#include "session.h"
+
+// A session is a sandbox whose child stops short of step 7 and stays behind
+// as root, as the init process of the sandbox PID namespace. It takes
+// commands over 'sock' in the pexecd(8) wire format and runs each in a child
+// of its own, which performs steps 7 and 8.
+struct protect_exec_session {
+	pthread_mutex_t lock;
+	struct sandbox sandbox;
+	pid_t stub_pid;
+	int sock;
+	bool killed;
+};
+
+// Requests received by a session stub. The stub is a clone(2) of a possibly
+// multi-threaded caller and may inherit a malloc(3) lock held by a thread
+// that does not exist in it, so it decodes into static storage instead.
+static struct pexec_proto_storage stub_storage;
+
+static pid_t stub_fork(void);
+static int wait_response(int sock, unsigned int timeout_ms);
+static void close_other_fds(int keep_fd);
+static void session_kill(struct protect_exec_session *session);
+
+// Description:
+//   Build a sandbox once for many commands: place it, mount its root and
+//   clone a stub into new namespaces, which joins the cgroup and pivots into
+//   the root like protect_exec_ex(3) does.
+// Parameters:
+//   opts - Same as for protect_exec_ex(3). 'exec_path', 'argv', 'envp' and
+//          the time limits are ignored; they are given per command to
+//          protect_exec_session_run(3). Commands inherit 'stdio_fds' unless
+//          they set their own.
+// Returns:
+//   A session to pass to protect_exec_session_run(3) and
+//   protect_exec_session_close(3), or NULL on failure.
+struct protect_exec_session *protect_exec_session_open(const struct protect_exec_opts *opts)
+{
+	int step = 0;
+	int sv[2];
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	metrics_count_launch();
+
+	if(protect_exec_validate_input(opts, false))
+	{
+		debug("protect_exec_session_open(3) failed. Input validation failed. (errno: %s)", clean_errno());
+		goto error_0;
+	}
+
+	struct protect_exec_session *session = calloc(1, sizeof(*session));
+
+	if(session == NULL)
+	{
+		debug("calloc(3) failed. (errno: %s)", clean_errno());
+		goto error_0;
+	}
+
+	if(sandbox_prepare(opts, &session->sandbox, &step))
+	{
+		goto error_1;
+	}
+
+	step = 3;
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv))
+	{
+		debug("socketpair(2) failed. (errno: %s)", clean_errno());
+		goto error_2;
+	}
+
+	struct protect_exec_args args;
+	args.opts = opts;
+	args.cgroup_path = session->sandbox.cgroup_path;
+	args.placement = &session->sandbox.placement;
+	args.deadline = NULL;
+	args.start = NULL;
+	args.mnt_fd = session->sandbox.mnt_fd;
+	args.session_sock = sv[1];
+
+	session->stub_pid = sandbox_clone(&args, 0, NULL);
+	close(sv[1]);
+
+	if(session->stub_pid == -1)
+	{
+		close(sv[0]);
+		goto error_2;
+	}
+
+	session->sock = sv[0];
+
+	// Wait for the stub to get through steps 4 to 6. It counts its own
+	// failures there.
+	if(pexec_proto_recv_response(session->sock, NULL))
+	{
+		debug("protect_exec_session_open(3) failed. Session stub did not start. (errno: %s)", clean_errno());
+		session_kill(session);
+		waitpid(session->stub_pid, NULL, 0);
+		close(session->sock);
+		step = -1;
+		goto error_2;
+	}
+
+	pthread_mutex_init(&session->lock, NULL);
+	metrics_observe_setup(&start);
+	metrics_add_sandboxes(1);
+
+	return session;
+
+error_2:
+	sandbox_release(&session->sandbox);
+error_1:
+	free(session);
+error_0:
+	metrics_count_failure(step);
+	return NULL;
+}
+
+// Description:
+//   Run a command inside an open session and wait for it. Costs one fork(2)
+//   and execve(2) in the sandbox instead of a full launch. Commands of a
+//   session run one at a time.
+// Parameters:
+//   opts - 'exec_path', 'argv', 'envp', 'stdio_fds' and 'wall_timeout_ms'
+//          of the command. Other fields are fixed when the session is
+//          opened. A command exceeding its wall-clock limit kills the whole
+//          session, which can then only be closed. 'cpu_timeout_ms' is not
+//          supported and must be 0.
+//   result - Receives the outcome of the command. May be NULL.
+// Returns:
+//   0 if the command was run and reaped, -1 otherwise.
+int protect_exec_session_run(struct protect_exec_session *session,
+                             const struct protect_exec_opts *opts,
+                             struct protect_exec_result *result)
+{
+	int ret = -1;
+
+	if(session == NULL || opts == NULL || opts->exec_path == NULL || opts->argv == NULL || opts->envp == NULL)
+	{
+		debug("protect_exec_session_run(3) input is invalid.");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(opts->cpu_timeout_ms != 0)
+	{
+		debug("protect_exec_session_run(3) does not support CPU time limits.");
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&session->lock);
+
+	if(session->killed)
+	{
+		debug("protect_exec_session_run(3) failed. Session was killed.");
+		errno = ESRCH;
+		goto error;
+	}
+
+	// Only the command fields mean anything to the stub
+	struct protect_exec_opts command = *opts;
+	command.fs_path = "";
+	command.mnt_path = "";
+	command.cgroup_path = NULL;
+
+	if(pexec_proto_send_request(session->sock, &command, -1))
+	{
+		debug("protect_exec_session_run(3) failed. Command could not be sent. (errno: %s)", clean_errno());
+		goto error;
+	}
+
+	int ready = wait_response(session->sock, opts->wall_timeout_ms);
+
+	if(ready == 0)
+	{
+		debug("Session command exceeded its wall-clock time limit. Killing the session.");
+		session_kill(session);
+
+		if(result != NULL)
+		{
+			result->status = SIGKILL;
+			result->deadline_exceeded = PROTECT_EXEC_DEADLINE_WALL;
+		}
+
+		metrics_count_deadline(PROTECT_EXEC_DEADLINE_WALL);
+		ret = 0;
+		goto error;
+	}
+
+	if(ready == -1 || pexec_proto_recv_response(session->sock, result))
+	{
+		debug("protect_exec_session_run(3) failed. No response from the session stub. (errno: %s)", clean_errno());
+		goto error;
+	}
+
+	ret = 0;
+
+error:
+	pthread_mutex_unlock(&session->lock);
+	return ret;
+}
+
+// Description:
+//   Kill every process left in a session, then unmount its root and release
+//   its loopback device as protect_exec_ex(3) does after a launch.
+void protect_exec_session_close(struct protect_exec_session *session)
+{
+	if(session == NULL)
+	{
+		return;
+	}
+
+	close(session->sock);
+	session_kill(session);
+
+	while(waitpid(session->stub_pid, NULL, 0) == -1 && errno == EINTR)
+	{
+	}
+
+	metrics_add_sandboxes(-1);
+	sandbox_release(&session->sandbox);
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
+
+// Description:
+//   Body of the session stub, in place of steps 7 and 8. Reports readiness,
+//   then runs one command per request until the session is closed. Neither
+//   the stub nor its command children allocate, go through fork(2) handlers
+//   or use the C library's set-ID wrappers, any of which could wait for
+//   locks held by, or replies from, threads of the caller that were not
+//   cloned. Commands drop privileges in sandbox_exec() with the system calls
+//   themselves.
+// Parameters:
+//   sock - Stub end of the session socket.
+//   uid - UID every command runs as, whatever its request says.
+// Returns:
+//   0 once the session socket is closed.
+int session_serve(int sock, uid_t uid)
+{
+	struct protect_exec_result result;
+	memset(&result, 0, sizeof(result));
+
+	// Descriptors of the caller, including the sockets of other sessions,
+	// would otherwise be held open for as long as this session lives
+	close_other_fds(sock);
+
+	if(pexec_proto_send_response(sock, 0, 0, &result))
+	{
+		return -1;
+	}
+
+	for(;;)
+	{
+		struct pexec_proto_request req;
+
+		if(pexec_proto_recv_request_into(sock, &req, &stub_storage))
+		{
+			break;
+		}
+
+		int ret = 0;
+		int error = 0;
+		int status = 0;
+		pid_t pid = stub_fork();
+
+		if(pid == 0)
+		{
+			int step;
+			sandbox_exec(&req.opts, uid, NULL, NULL, &step);
+			metrics_count_failure(step);
+			_exit(255);
+		}
+
+		if(pid == -1)
+		{
+			ret = -1;
+			error = errno;
+		}
+
+		// As init, also reap whatever earlier commands left behind
+		while(pid != -1)
+		{
+			pid_t reaped = waitpid(-1, &status, 0);
+
+			if(reaped == pid)
+			{
+				break;
+			}
+
+			if(reaped == -1 && errno != EINTR)
+			{
+				ret = -1;
+				error = errno;
+				break;
+			}
+		}
+
+		pexec_proto_request_free(&req);
+		result.status = status;
+
+		if(pexec_proto_send_response(sock, ret, error, &result))
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// Description:
+//   fork(2) through the raw system call, skipping the pthread_atfork(3)
+//   handlers and lock resets of the C library. One of those handlers takes
+//   the teardown lock, which a thread of the caller may have held when the
+//   stub was cloned.
+// Returns:
+//   As fork(2).
+static pid_t stub_fork(void)
+{
+	return (pid_t) syscall(__NR_clone, SIGCHLD, NULL, NULL, NULL, NULL);
+}
+
+// Returns:
+//   1 once a response can be read, 0 if 'timeout_ms' passed first (0 waits
+//   forever), -1 on failure.
+static int wait_response(int sock, unsigned int timeout_ms)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(;;)
+	{
+		int timeout = -1;
+
+		if(timeout_ms > 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			long long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000LL + (now.tv_nsec - start.tv_nsec) / 1000000;
+			timeout = elapsed_ms >= timeout_ms ? 0 : (int) (timeout_ms - elapsed_ms);
+		}
+
+		int ready = poll(&pfd, 1, timeout);
+
+		if(ready >= 0)
+		{
+			return ready;
+		}
+
+		if(errno != EINTR)
+		{
+			debug("poll(2) failed. (errno: %s)", clean_errno());
+			return -1;
+		}
+	}
+}
+
+// Description:
+//   Close every descriptor above stderr but 'keep_fd', one at a time on
+//   kernels without close_range(2).
+static void close_other_fds(int keep_fd)
+{
+	if((keep_fd == STDERR_FILENO + 1 || syscall(__NR_close_range, STDERR_FILENO + 1, keep_fd - 1, 0) == 0) &&
+	   syscall(__NR_close_range, keep_fd + 1, ~0U, 0) == 0)
+	{
+		return;
+	}
+
+	long max_fd = sysconf(_SC_OPEN_MAX);
+
+	for(int fd = STDERR_FILENO + 1; fd < max_fd; fd++)
+	{
+		if(fd != keep_fd)
+		{
+			close(fd);
+		}
+	}
+}
+
+// Description:
+//   Kill the stub. As the init process of the sandbox PID namespace, it
+//   takes every process of the session with it. The stub is not reaped
+//   until protect_exec_session_close(3), so its PID cannot be reused.
+static void session_kill(struct protect_exec_session *session)
+{
+	if(!session->killed && kill(session->stub_pid, SIGKILL))
+	{
+		debug("kill(2) failed. (errno: %s)", clean_errno());
+		debug("kill(%d, SIGKILL)", session->stub_pid);
+	}
+
+	session->killed = true;
+}
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "loopback.h"
+#include "metrics.h"
+#include "protect_exec.h"
+#include "teardown.h"
+
+// 'dev' and 'ino' identify the root of the mount, so that a launch can tell
+// whether its mount path still shows a root awaiting teardown.
+struct teardown_entry {
+	int mnt_fd;
+	int loop_fd;
+	dev_t dev;
+	ino_t ino;
+	struct timespec queued;
+	struct teardown_entry *next;
+};
+
+#if DEFERRED_TEARDOWN
+static void *reaper(void *data);
+static int reaper_start(void);
+static void teardown_batch(struct teardown_entry *batch);
+static void atfork_prepare(void);
+static void atfork_parent(void);
+static void atfork_child(void);
+#endif
+static bool teardown_pending(const struct teardown_entry *list, const struct stat *st);
+static void teardown_unmount(int mnt_fd);
+
+// Pending teardowns and the state of the reaper thread. 'reaper_batch' is
+// the batch taken off the queue that is being processed, if any.
+// 'teardown_idle' is signalled after every batch.
+static pthread_mutex_t teardown_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t teardown_idle = PTHREAD_COND_INITIALIZER;
+static struct teardown_entry *teardown_queue = NULL;
+static struct teardown_entry *reaper_batch = NULL;
+#if DEFERRED_TEARDOWN
+static pthread_cond_t teardown_wake = PTHREAD_COND_INITIALIZER;
+static bool reaper_running = false;
+static bool atfork_registered = false;
+#endif
+
+// Description:
+//   Unmount a sandbox root and release its loopback device, either on the
+//   reaper thread or, if DEFERRED_TEARDOWN is disabled or the reaper cannot
+//   be started, before returning.
+// Parameters:
+//   mnt_fd - O_PATH descriptor of the mounted root, or -1 if nothing was
+//            mounted. Closed by this call.
+//   loop_fd - Descriptor returned by loopback_setup(). Closed by this call.
+void teardown_defer(int mnt_fd, int loop_fd)
+{
+	struct timespec queued;
+	clock_gettime(CLOCK_MONOTONIC, &queued);
+
+#if DEFERRED_TEARDOWN
+	struct teardown_entry *entry = malloc(sizeof(*entry));
+
+	if(entry != NULL)
+	{
+		struct stat st;
+
+		entry->mnt_fd = mnt_fd;
+		entry->loop_fd = loop_fd;
+		entry->dev = 0;
+		entry->ino = 0;
+		entry->queued = queued;
+
+		if(mnt_fd != -1 && fstat(mnt_fd, &st) == 0)
+		{
+			entry->dev = st.st_dev;
+			entry->ino = st.st_ino;
+		}
+
+		pthread_mutex_lock(&teardown_lock);
+
+		if(reaper_running || reaper_start() == 0)
+		{
+			entry->next = teardown_queue;
+			teardown_queue = entry;
+			pthread_cond_signal(&teardown_wake);
+			pthread_mutex_unlock(&teardown_lock);
+			return;
+		}
+
+		pthread_mutex_unlock(&teardown_lock);
+		free(entry);
+	}
+
+	debug("Deferred teardown unavailable. Tearing down synchronously.");
+#endif
+
+	if(mnt_fd != -1)
+	{
+		teardown_unmount(mnt_fd);
+	}
+
+	loopback_release(loop_fd);
+	metrics_observe_teardown(&queued);
+}
+
+// Description:
+//   Block until no teardown is pending for the root currently mounted at
+//   'mnt_path'. Detaching a root detaches everything mounted over it, so a
+//   launch must not mount a new root at a path whose previous root the
+//   reaper has yet to detach.
+void teardown_wait_path(const char *mnt_path)
+{
+	struct stat st;
+
+	if(stat(mnt_path, &st))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&teardown_lock);
+
+	while(teardown_pending(teardown_queue, &st) || teardown_pending(reaper_batch, &st))
+	{
+		pthread_cond_wait(&teardown_idle, &teardown_lock);
+	}
+
+	pthread_mutex_unlock(&teardown_lock);
+}
+
+// Description:
+//   Block until every teardown handed to the reaper so far has completed.
+//   Call before reusing or removing a mount path passed to protect_exec(3),
+//   and before shutting down.
+void protect_exec_drain(void)
+{
+	pthread_mutex_lock(&teardown_lock);
+
+	while(teardown_queue != NULL || reaper_batch != NULL)
+	{
+		pthread_cond_wait(&teardown_idle, &teardown_lock);
+	}
+
+	pthread_mutex_unlock(&teardown_lock);
+}
+
+#if DEFERRED_TEARDOWN
+// Description:
+//   Reaper thread body. Takes everything queued since its last pass as one
+//   batch, so that a burst of launches finishing together is torn down in a
+//   single wakeup.
+static void *reaper(void *data)
+{
+	(void) data;
+
+	pthread_mutex_lock(&teardown_lock);
+
+	for(;;)
+	{
+		while(teardown_queue == NULL)
+		{
+			pthread_cond_wait(&teardown_wake, &teardown_lock);
+		}
+
+		reaper_batch = teardown_queue;
+		teardown_queue = NULL;
+
+		pthread_mutex_unlock(&teardown_lock);
+		teardown_batch(reaper_batch);
+		pthread_mutex_lock(&teardown_lock);
+
+		// Waiters look at the batch until it is gone
+		while(reaper_batch != NULL)
+		{
+			struct teardown_entry *next = reaper_batch->next;
+			free(reaper_batch);
+			reaper_batch = next;
+		}
+
+		pthread_cond_broadcast(&teardown_idle);
+	}
+
+	return NULL;
+}
+
+// Description:
+//   Start the reaper thread with all signals blocked, so that signals meant
+//   for the application are never delivered to it. Must be called with
+//   'teardown_lock' held.
+// Returns:
+//   0 on success, -1 on failure.
+static int reaper_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t all_signals;
+	sigset_t old_signals;
+
+	if(!atfork_registered)
+	{
+		if(pthread_atfork(atfork_prepare, atfork_parent, atfork_child))
+		{
+			debug("pthread_atfork(3) failed.");
+			return -1;
+		}
+
+		atfork_registered = true;
+	}
+
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int err = pthread_create(&thread, &attr, reaper, NULL);
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	if(err)
+	{
+		errno = err;
+		debug("pthread_create(3) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	reaper_running = true;
+
+	return 0;
+}
+
+// Description:
+//   Detach every mount in a batch before releasing any loopback device, so
+//   that autoclearing devices are already unused when their descriptors are
+//   closed.
+static void teardown_batch(struct teardown_entry *batch)
+{
+	for(struct teardown_entry *entry = batch; entry != NULL; entry = entry->next)
+	{
+		if(entry->mnt_fd != -1)
+		{
+			teardown_unmount(entry->mnt_fd);
+		}
+	}
+
+	for(struct teardown_entry *entry = batch; entry != NULL; entry = entry->next)
+	{
+		loopback_release(entry->loop_fd);
+		metrics_observe_teardown(&entry->queued);
+	}
+}
+#endif
+
+// Returns:
+//   Whether 'list' has an entry for the root that 'st' describes.
+static bool teardown_pending(const struct teardown_entry *list, const struct stat *st)
+{
+	for(; list != NULL; list = list->next)
+	{
+		if(list->mnt_fd != -1 && list->dev == st->st_dev && list->ino == st->st_ino)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Description:
+//   Lazily unmount the mount referred to by an O_PATH descriptor of its root
+//   and close the descriptor.
+static void teardown_unmount(int mnt_fd)
+{
+	char mnt_fd_path[32];
+	snprintf(mnt_fd_path, sizeof(mnt_fd_path), "/proc/self/fd/%d", mnt_fd);
+
+	if(umount2(mnt_fd_path, MNT_DETACH))
+	{
+		debug("umount2(2) failed. (errno: %s)", clean_errno());
+		debug("umount2(\"%s\", MNT_DETACH)", mnt_fd_path);
+	}
+
+	if(close(mnt_fd))
+	{
+		debug("close(2) failed. (errno: %s)", clean_errno());
+		debug("close(%d)", mnt_fd);
+	}
+}
+
+#if DEFERRED_TEARDOWN
+static void atfork_prepare(void)
+{
+	pthread_mutex_lock(&teardown_lock);
+}
+
+static void atfork_parent(void)
+{
+	pthread_mutex_unlock(&teardown_lock);
+}
+
+// Description:
+//   The reaper does not survive fork(2). Pending teardowns belong to the
+//   parent, so the child only drops its copies of their descriptors and
+//   starts a reaper of its own when it next needs one. The reaper may have
+//   been partway through its batch, whose descriptors the parent may already
+//   have closed and reused, so those are left open here; like every
+//   descriptor of the library they are close-on-exec.
+static void atfork_child(void)
+{
+	while(teardown_queue != NULL)
+	{
+		struct teardown_entry *next = teardown_queue->next;
+
+		if(teardown_queue->mnt_fd != -1)
+		{
+			close(teardown_queue->mnt_fd);
+		}
+
+		close(teardown_queue->loop_fd);
+		free(teardown_queue);
+		teardown_queue = next;
+	}
+
+	while(reaper_batch != NULL)
+	{
+		struct teardown_entry *next = reaper_batch->next;
+		free(reaper_batch);
+		reaper_batch = next;
+	}
+
+	reaper_running = false;
+	pthread_cond_init(&teardown_wake, NULL);
+	pthread_cond_init(&teardown_idle, NULL);
+
+	pthread_mutex_unlock(&teardown_lock);
+}
+#endif
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "harness.h"
+
+// Description:
+//   Change the current working directory to the directory containing the
+//   current process' executable.
+// Returns:
+//   0 on success, -1 on failure.
+int harness_chdir_exec(void)
+{
+	char program_path[4096];
+	ssize_t program_path_size = readlink("/proc/self/exe", program_path, sizeof(program_path) - 1);
+
+	if(program_path_size == -1)
+	{
+		debug("readlink(2) failed.");
+		debug("readlink(\"/proc/self/exe\", program_path, sizeof(program_path))");
+		return -1;
+	}
+
+	program_path[program_path_size] = 0;
+
+	if(chdir(dirname(program_path)))
+	{
+		debug("chdir(2) failed.");
+		debug("chdir(\"%s\")", program_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Calculate the path of the SquashFS image 'root.sqsh' built next to the
+//   executable. Call after harness_chdir_exec().
+void harness_image_path(char *fs_path, size_t size)
+{
+	char cwd_path[PATH_MAX];
+
+	if(getcwd(cwd_path, sizeof(cwd_path)) == NULL)
+	{
+		cwd_path[0] = 0;
+	}
+
+	snprintf(fs_path, size, "%s/root.sqsh", cwd_path);
+}
+
+// Description:
+//   Use the cgroup hierarchy at 'given_path' or, if it is NULL, mount one
+//   with 'controller' at /tmp/'name'. Then create 'child_name' below it,
+//   unless that is NULL.
+// Parameters:
+//   cgroup - Receives the paths and what to undo in harness_cgroup_close().
+//            'path' is the child if there is one, the root otherwise.
+// Returns:
+//   0 on success, -1 on failure, with anything already set up undone.
+int harness_cgroup_open(struct harness_cgroup *cgroup, const char *given_path,
+                        const char *name, const char *controller,
+                        const char *child_name)
+{
+	cgroup->mounted = false;
+	cgroup->child_created = false;
+
+	if(given_path != NULL)
+	{
+		snprintf(cgroup->root_path, sizeof(cgroup->root_path), "%s", given_path);
+	}
+	else
+	{
+		snprintf(cgroup->root_path, sizeof(cgroup->root_path), "/tmp/%s", name);
+
+		if(mkdir(cgroup->root_path, 0755))
+		{
+			log_err("mkdir(2) failed.");
+			log_err("mkdir(\"%s\", 0755)", cgroup->root_path);
+			return -1;
+		}
+
+		if(mount(name, cgroup->root_path, "cgroup", 0, controller))
+		{
+			log_err("mount(2) failed.");
+			log_err("mount(\"%s\", \"%s\", \"cgroup\", 0, \"%s\")", name, cgroup->root_path, controller);
+			rmdir(cgroup->root_path);
+			return -1;
+		}
+
+		cgroup->mounted = true;
+	}
+
+	if(child_name == NULL)
+	{
+		snprintf(cgroup->path, sizeof(cgroup->path), "%s", cgroup->root_path);
+		return 0;
+	}
+
+	int length = snprintf(cgroup->path, sizeof(cgroup->path), "%s/%s", cgroup->root_path, child_name);
+
+	if(length < 0 || (size_t) length >= sizeof(cgroup->path))
+	{
+		log_err("Child cgroup path is too long. (root_path: \"%s\")", cgroup->root_path);
+		harness_cgroup_close(cgroup);
+		return -1;
+	}
+
+	if(mkdir(cgroup->path, 0755))
+	{
+		log_err("mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", cgroup->path);
+		harness_cgroup_close(cgroup);
+		return -1;
+	}
+
+	cgroup->child_created = true;
+
+	return 0;
+}
+
+// Description:
+//   Remove the child cgroup and unmount the hierarchy, if
+//   harness_cgroup_open() created them.
+void harness_cgroup_close(struct harness_cgroup *cgroup)
+{
+	if(cgroup->child_created && rmdir(cgroup->path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", cgroup->path);
+	}
+
+	if(cgroup->mounted)
+	{
+		if(umount2(cgroup->root_path, MNT_DETACH))
+		{
+			log_err("umount2(2) failed.");
+			log_err("umount2(\"%s\", MNT_DETACH)", cgroup->root_path);
+		}
+
+		if(rmdir(cgroup->root_path))
+		{
+			log_err("rmdir(2) failed.");
+			log_err("rmdir(\"%s\")", cgroup->root_path);
+		}
+	}
+
+	cgroup->child_created = false;
+	cgroup->mounted = false;
+}
+
+// Returns:
+//   Number of lines in the file, -1 on failure.
+long harness_count_lines(const char *path)
+{
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL)
+	{
+		log_err("fopen(3) failed.");
+		log_err("fopen(\"%s\", \"r\")", path);
+		return -1;
+	}
+
+	long lines = 0;
+	int c;
+
+	while((c = fgetc(file)) != EOF)
+	{
+		lines += c == '\n';
+	}
+
+	fclose(file);
+
+	return lines;
+}
+
+// Description:
+//   Add the processes of the cgroup at 'path' and of every cgroup below it
+//   to 'procs', and the leaf cgroups that protect_exec_ex(3) created among
+//   them to 'leaves'.
+// Returns:
+//   0 on success, -1 on failure.
+int harness_count_cgroup_tree(const char *path, long *procs, long *leaves)
+{
+	char child_path[PATH_MAX];
+	int length = snprintf(child_path, sizeof(child_path), "%s/cgroup.procs", path);
+
+	if(length < 0 || (size_t) length >= sizeof(child_path))
+	{
+		log_err("Cgroup path is too long. (path: \"%s\")", path);
+		return -1;
+	}
+
+	long count = harness_count_lines(child_path);
+
+	if(count < 0)
+	{
+		return -1;
+	}
+
+	*procs += count;
+
+	DIR *dir = opendir(path);
+
+	if(dir == NULL)
+	{
+		log_err("opendir(3) failed.");
+		log_err("opendir(\"%s\")", path);
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent *de;
+
+	while(ret == 0 && (de = readdir(dir)))
+	{
+		if(de->d_type != DT_DIR || !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		{
+			continue;
+		}
+
+		*leaves += !strncmp(de->d_name, CGROUP_LEAF_PREFIX "-", strlen(CGROUP_LEAF_PREFIX "-"));
+		length = snprintf(child_path, sizeof(child_path), "%s/%s", path, de->d_name);
+
+		if(length < 0 || (size_t) length >= sizeof(child_path))
+		{
+			log_err("Cgroup path is too long. (path: \"%s\")", path);
+			ret = -1;
+			break;
+		}
+
+		ret = harness_count_cgroup_tree(child_path, procs, leaves);
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+double harness_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Description:
+//   qsort(3) comparator for doubles, in ascending order.
+int harness_compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
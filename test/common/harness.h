@@ -0,0 +1,32 @@
+#ifndef _PROTECT_EXEC_HARNESS_H
+#define _PROTECT_EXEC_HARNESS_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+// Control Group a test or benchmark launches into: the root of a hierarchy
+// given on the command line, or of one mounted for the run, or a child
+// created below either.
+struct harness_cgroup {
+	char root_path[PATH_MAX];
+	char path[PATH_MAX];
+	bool mounted;
+	bool child_created;
+};
+
+extern int harness_chdir_exec(void);
+extern void harness_image_path(char *fs_path, size_t size);
+
+extern int harness_cgroup_open(struct harness_cgroup *cgroup, const char *given_path,
+                               const char *name, const char *controller,
+                               const char *child_name);
+extern void harness_cgroup_close(struct harness_cgroup *cgroup);
+
+extern long harness_count_lines(const char *path);
+extern int harness_count_cgroup_tree(const char *path, long *procs, long *leaves);
+extern double harness_elapsed_ms(const struct timespec *start);
+extern int harness_compare_double(const void *a, const void *b);
+
+#endif
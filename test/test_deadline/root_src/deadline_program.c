@@ -0,0 +1,30 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+
+// Usage: deadline_program exit|sleep|spin
+// "sleep" and "spin" fork a child that does the same, so that the whole
+// sandbox, not only its init process, has to be killed.
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "exit";
+
+	if(strcmp(mode, "exit") == 0)
+	{
+		return 0;
+	}
+
+	fork();
+
+	if(strcmp(mode, "sleep") == 0)
+	{
+		for(;;)
+		{
+			pause();
+		}
+	}
+
+	for(volatile unsigned long i = 0;; i++)
+	{
+	}
+}
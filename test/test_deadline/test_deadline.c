@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "harness.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME       "protect_exec_deadline_test_cgroup"
+#define CGROUP_CHILD_NAME "protect_exec_deadline"
+#define EXEC_PATH         "/deadline_program"
+#define ROOT_MNT_PATH     "/tmp/protect_exec_test_deadline_mnt"
+#define KILL_SLACK_MS     500
+
+// A launch of deadline_program in 'mode' and the limit it is expected to hit
+// within 'max_elapsed_ms'.
+struct deadline_case {
+	const char *mode;
+	unsigned int wall_timeout_ms;
+	unsigned int cpu_timeout_ms;
+	int expected;
+	double max_elapsed_ms;
+};
+
+// The CPU case allows for RLIMIT_CPU, which counts whole seconds per process,
+// on cgroups without CPU accounting.
+static const struct deadline_case cases[] = {
+	{ "exit",  10000, 10000, PROTECT_EXEC_DEADLINE_NONE, 10000 },
+	{ "sleep", 200,   0,     PROTECT_EXEC_DEADLINE_WALL, 200 + KILL_SLACK_MS },
+	{ "spin",  10000, 300,   PROTECT_EXEC_DEADLINE_CPU,  5000 },
+};
+
+static int run_case(const struct deadline_case *test_case, struct protect_exec_opts *opts);
+static pid_t spawn_bystander(const char *cgroup_path);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	struct harness_cgroup cgroup;
+	int ret = 1;
+
+	// UID must be specified as the first command-line argument
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	// Set the current working directory to the directory containing this
+	// executable.
+	if(harness_chdir_exec())
+	{
+		log_err("Test failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	// If a second command-line argument has been given, treat that as a
+	// path to the root of an existing Control Group filesystem (v1 or v2).
+	// Otherwise, mount a new Control Group filesystem. Either way, launch
+	// into a dedicated child cgroup.
+	if(harness_cgroup_open(&cgroup, argc > 2 ? argv[2] : NULL, CGROUP_NAME, "cpu", CGROUP_CHILD_NAME))
+	{
+		log_err("Test failed. Could not set up a cgroup.");
+		goto error_0;
+	}
+
+	const char *mnt_path = ROOT_MNT_PATH;
+
+	// Calculate path of SquashFS filesystem.
+	char fs_path[PATH_MAX];
+	harness_image_path(fs_path, sizeof(fs_path));
+
+	if(mkdir(mnt_path, 0755))
+	{
+		log_err("Test failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", mnt_path);
+		goto error_1;
+	}
+
+	struct protect_exec_opts opts;
+	protect_exec_opts_init(&opts);
+	opts.uid = (uid_t) atoi(argv[1]);
+	opts.fs_path = fs_path;
+	opts.mnt_path = mnt_path;
+	opts.cgroup_path = cgroup.path;
+	opts.exec_path = EXEC_PATH;
+
+	// A process of another tenant of the cgroup, which no sandbox running
+	// out of time may take with it
+	pid_t bystander = spawn_bystander(cgroup.path);
+
+	if(bystander == -1)
+	{
+		log_err("Test failed. Could not start a process in the cgroup.");
+		goto error_2;
+	}
+
+	int failed = 0;
+
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		failed |= run_case(&cases[i], &opts);
+
+		// Every launch reuses mnt_path
+		protect_exec_drain();
+	}
+
+	if(waitpid(bystander, NULL, WNOHANG) != 0)
+	{
+		log_err("Test failed. A process sharing the cgroup was killed.");
+		failed = 1;
+	}
+
+	kill(bystander, SIGKILL);
+	waitpid(bystander, NULL, 0);
+
+	if(!failed)
+	{
+		ret = 0;
+	}
+
+error_2:
+	if(rmdir(mnt_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", mnt_path);
+	}
+error_1:
+	harness_cgroup_close(&cgroup);
+error_0:
+	return ret;
+}
+
+// Description:
+//   Launch one case and check the limit it hit, how long it took and that
+//   no process of the sandbox survived it. The sandbox runs in a leaf cgroup
+//   of its own, which cannot be removed while a process is left in it, so
+//   the whole subtree of the cgroup is counted.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_case(const struct deadline_case *test_case, struct protect_exec_opts *opts)
+{
+	char *const exec_argv[] = { EXEC_PATH, (char *) test_case->mode, NULL };
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_result result;
+	struct timespec start;
+
+	opts->argv = exec_argv;
+	opts->envp = exec_envp;
+	opts->wall_timeout_ms = test_case->wall_timeout_ms;
+	opts->cpu_timeout_ms = test_case->cpu_timeout_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(protect_exec_ex(opts, &result))
+	{
+		log_err("Test failed. protect_exec_ex(3) failed. (mode: %s)", test_case->mode);
+		return -1;
+	}
+
+	double elapsed = harness_elapsed_ms(&start);
+
+	long procs = 0;
+	long leaves = 0;
+
+	if(harness_count_cgroup_tree(opts->cgroup_path, &procs, &leaves))
+	{
+		log_err("Test failed. Could not count the processes left in the cgroup. (mode: %s)", test_case->mode);
+		return -1;
+	}
+
+	// The bystander is the only process the subtree should hold
+	long survivors = procs - 1;
+
+	log_info("Mode '%s': deadline %d, status %#x, %.1f ms, %ld survivors, %ld leaf cgroups left.",
+		test_case->mode, result.deadline_exceeded, result.status, elapsed, survivors, leaves);
+
+	if(result.deadline_exceeded != test_case->expected)
+	{
+		log_err("Test failed. Expected deadline %d. (mode: %s)", test_case->expected, test_case->mode);
+		return -1;
+	}
+
+	if(test_case->expected != PROTECT_EXEC_DEADLINE_NONE && !WIFSIGNALED(result.status))
+	{
+		log_err("Test failed. Program was not killed. (mode: %s)", test_case->mode);
+		return -1;
+	}
+
+	if(elapsed > test_case->max_elapsed_ms)
+	{
+		log_err("Test failed. Took longer than %.0f ms. (mode: %s)", test_case->max_elapsed_ms, test_case->mode);
+		return -1;
+	}
+
+	if(survivors != 0 || leaves != 0)
+	{
+		log_err("Test failed. Processes or the leaf cgroup of the sandbox survived it. (mode: %s)", test_case->mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Fork a process that sleeps in 'cgroup_path' until it is killed.
+// Returns:
+//   PID of the process, or -1 on failure.
+static pid_t spawn_bystander(const char *cgroup_path)
+{
+	char procs_path[PATH_MAX];
+	snprintf(procs_path, sizeof(procs_path), "%s/cgroup.procs", cgroup_path);
+
+	pid_t pid = fork();
+
+	if(pid == 0)
+	{
+		for(;;)
+		{
+			pause();
+		}
+	}
+
+	if(pid == -1)
+	{
+		return -1;
+	}
+
+	FILE *procs = fopen(procs_path, "w");
+	int written = procs == NULL ? -1 : fprintf(procs, "%d\n", pid);
+
+	if(procs == NULL || fclose(procs) || written < 0)
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	return pid;
+}
+
+static void usage(void)
+{
+	puts("USAGE: test_deadline UID [CGROUP_PATH]");
+}
@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Flag of get_mempolicy(2), from <linux/mempolicy.h>
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+#define MAX_NODES 1024
+
+// Print the CPUs this process may run on and the memory nodes it may
+// allocate from, one comma-separated list per line. The sandbox has no
+// /proc, so they are asked of the kernel directly.
+int main(void)
+{
+	cpu_set_t cpus;
+	unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+	const char *separator = "";
+
+	if(sched_getaffinity(0, sizeof(cpus), &cpus) ||
+	   syscall(__NR_get_mempolicy, NULL, nodes, MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED))
+	{
+		return 1;
+	}
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, &cpus))
+		{
+			printf("%s%d", separator, cpu);
+			separator = ",";
+		}
+	}
+
+	printf("\n");
+	separator = "";
+
+	for(int node = 0; node < MAX_NODES; node++)
+	{
+		if(nodes[node / (8 * sizeof(unsigned long))] & (1UL << (node % (8 * sizeof(unsigned long)))))
+		{
+			printf("%s%d", separator, node);
+			separator = ",";
+		}
+	}
+
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "harness.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME   "protect_exec_placement_test_cgroup"
+#define EXEC_PATH     "/placement_program"
+#define ROOT_MNT_PATH "/tmp/protect_exec_test_placement_mnt"
+#define MAX_AUTO_CPUS 2
+#define LIST_SIZE     4096
+
+// Requests that placement_resolve() must refuse with EINVAL
+static const struct {
+	const char *cpus;
+	const char *mems;
+} malformed[] = {
+	{ "0-",  NULL },
+	{ "3-1", NULL },
+	{ "a",   NULL },
+	{ "0",   "0,x" },
+};
+
+static int run_explicit(struct protect_exec_opts *opts, const cpu_set_t *host_cpus, bool mems_enforced);
+static int run_auto(struct protect_exec_opts *opts, const cpu_set_t *host_cpus);
+static int run_malformed(struct protect_exec_opts *opts);
+static int launch(struct protect_exec_opts *opts, char *cpus_list, char *mems_list);
+static bool cpuset_enabled(const char *cgroup_path);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	struct harness_cgroup cgroup;
+	int ret = 1;
+
+	// UID must be specified as the first command-line argument
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	// Set the current working directory to the directory containing this
+	// executable.
+	if(harness_chdir_exec())
+	{
+		log_err("Test failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	// If a second command-line argument has been given, treat that as a
+	// path to the root of an existing Control Group filesystem (v1 or v2).
+	// Otherwise, mount a new cpuset hierarchy. Placed launches create their
+	// own cgroups below it, which on cgroup v1 take its CPUs and memory
+	// nodes, so no child is created in between.
+	if(harness_cgroup_open(&cgroup, argc > 2 ? argv[2] : NULL, CGROUP_NAME, "cpuset", NULL))
+	{
+		log_err("Test failed. Could not set up a cgroup.");
+		goto error_0;
+	}
+
+	cpu_set_t host_cpus;
+
+	if(sched_getaffinity(0, sizeof(host_cpus), &host_cpus))
+	{
+		log_err("Test failed. sched_getaffinity(2) failed.");
+		goto error_1;
+	}
+
+	const char *mnt_path = ROOT_MNT_PATH;
+
+	// Calculate path of SquashFS filesystem.
+	char fs_path[PATH_MAX];
+	harness_image_path(fs_path, sizeof(fs_path));
+
+	if(mkdir(mnt_path, 0755))
+	{
+		log_err("Test failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", mnt_path);
+		goto error_1;
+	}
+
+	char *const exec_argv[] = { EXEC_PATH, NULL };
+	char *const exec_envp[] = { NULL };
+
+	struct protect_exec_opts opts;
+	protect_exec_opts_init(&opts);
+	opts.uid = (uid_t) atoi(argv[1]);
+	opts.fs_path = fs_path;
+	opts.mnt_path = mnt_path;
+	opts.cgroup_path = cgroup.path;
+	opts.exec_path = EXEC_PATH;
+	opts.argv = exec_argv;
+	opts.envp = exec_envp;
+
+	// Without the cpuset controller, a launch is only pinned to its CPUs
+	bool mems_enforced = cpuset_enabled(cgroup.path);
+
+	if(!mems_enforced)
+	{
+		log_info("No cpuset controller at \"%s\". Memory nodes are not checked.", cgroup.path);
+	}
+
+	int failed = run_explicit(&opts, &host_cpus, mems_enforced);
+	failed |= run_auto(&opts, &host_cpus);
+	failed |= run_malformed(&opts);
+
+	protect_exec_drain();
+
+	if(!failed)
+	{
+		ret = 0;
+	}
+
+	if(rmdir(mnt_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", mnt_path);
+	}
+error_1:
+	harness_cgroup_close(&cgroup);
+error_0:
+	return ret;
+}
+
+// Description:
+//   Confine a launch to the last CPU this test may run on and to memory
+//   node 0, and check that the program sees exactly those.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_explicit(struct protect_exec_opts *opts, const cpu_set_t *host_cpus, bool mems_enforced)
+{
+	char requested_cpus[16];
+	char cpus_list[LIST_SIZE];
+	char mems_list[LIST_SIZE];
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, host_cpus))
+		{
+			snprintf(requested_cpus, sizeof(requested_cpus), "%d", cpu);
+		}
+	}
+
+	opts->cpus = requested_cpus;
+	opts->mems = "0";
+	opts->auto_cpus = 0;
+
+	int launched = launch(opts, cpus_list, mems_list);
+
+	opts->cpus = NULL;
+	opts->mems = NULL;
+
+	if(launched)
+	{
+		return -1;
+	}
+
+	log_info("Explicit placement: requested cpus \"%s\" mems \"0\", got cpus \"%s\" mems \"%s\".",
+		requested_cpus, cpus_list, mems_list);
+
+	if(strcmp(cpus_list, requested_cpus))
+	{
+		log_err("Test failed. Program runs on other CPUs than requested.");
+		return -1;
+	}
+
+	if(mems_enforced && strcmp(mems_list, "0"))
+	{
+		log_err("Test failed. Program allocates from other memory nodes than requested.");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Let the library choose up to MAX_AUTO_CPUS of the CPUs this test may run
+//   on, and check that the program sees that many of them.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_auto(struct protect_exec_opts *opts, const cpu_set_t *host_cpus)
+{
+	char cpus_list[LIST_SIZE];
+	char mems_list[LIST_SIZE];
+	int count = CPU_COUNT(host_cpus) < MAX_AUTO_CPUS ? CPU_COUNT(host_cpus) : MAX_AUTO_CPUS;
+
+	opts->auto_cpus = count;
+
+	int launched = launch(opts, cpus_list, mems_list);
+
+	opts->auto_cpus = 0;
+
+	if(launched)
+	{
+		return -1;
+	}
+
+	log_info("Automatic placement: requested %d CPUs, got cpus \"%s\" mems \"%s\".", count, cpus_list, mems_list);
+
+	int seen = 0;
+
+	for(char *cursor = cpus_list; *cursor != 0; cursor++)
+	{
+		int cpu = (int) strtol(cursor, &cursor, 10);
+
+		if(!CPU_ISSET(cpu, host_cpus))
+		{
+			log_err("Test failed. Program runs on CPU %d, which this test may not.", cpu);
+			return -1;
+		}
+
+		seen++;
+
+		if(*cursor == 0)
+		{
+			break;
+		}
+	}
+
+	if(seen != count || mems_list[0] == 0)
+	{
+		log_err("Test failed. Program runs on %d CPUs instead of %d.", seen, count);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Check that every malformed CPU or memory node list fails the launch with
+//   EINVAL.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_malformed(struct protect_exec_opts *opts)
+{
+	struct protect_exec_result result;
+	int ret = 0;
+
+	for(size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+	{
+		opts->cpus = malformed[i].cpus;
+		opts->mems = malformed[i].mems;
+
+		if(protect_exec_ex(opts, &result) == 0 || errno != EINVAL)
+		{
+			log_err("Test failed. Launch was not refused with EINVAL. (cpus: \"%s\", mems: \"%s\")",
+				malformed[i].cpus, malformed[i].mems ? malformed[i].mems : "");
+			ret = -1;
+		}
+	}
+
+	opts->cpus = NULL;
+	opts->mems = NULL;
+
+	return ret;
+}
+
+// Description:
+//   Launch placement_program with its stdout on a pipe, and read back the
+//   CPUs and memory nodes it reports.
+// Parameters:
+//   cpus_list, mems_list - Receive the lists, LIST_SIZE bytes each.
+// Returns:
+//   0 on success, -1 on failure.
+static int launch(struct protect_exec_opts *opts, char *cpus_list, char *mems_list)
+{
+	struct protect_exec_result result;
+	char output[2 * LIST_SIZE];
+	int pipe_fds[2];
+	int ret = -1;
+
+	if(pipe2(pipe_fds, O_CLOEXEC))
+	{
+		log_err("Test failed. pipe2(2) failed.");
+		return -1;
+	}
+
+	opts->stdio_fds[1] = pipe_fds[1];
+
+	int launched = protect_exec_ex(opts, &result);
+
+	opts->stdio_fds[1] = -1;
+	close(pipe_fds[1]);
+
+	if(launched || !WIFEXITED(result.status) || WEXITSTATUS(result.status) != 0)
+	{
+		log_err("Test failed. Placed launch failed. (cpus: \"%s\", mems: \"%s\", auto_cpus: %d)",
+			opts->cpus ? opts->cpus : "", opts->mems ? opts->mems : "", opts->auto_cpus);
+		goto error;
+	}
+
+	// Every launch reuses mnt_path
+	protect_exec_drain();
+
+	ssize_t length = read(pipe_fds[0], output, sizeof(output) - 1);
+
+	if(length <= 0)
+	{
+		log_err("Test failed. No output from the program.");
+		goto error;
+	}
+
+	output[length] = 0;
+
+	if(sscanf(output, "%4095[0-9,]\n%4095[0-9,]", cpus_list, mems_list) != 2)
+	{
+		log_err("Test failed. Unexpected output from the program. (output: \"%s\")", output);
+		goto error;
+	}
+
+	ret = 0;
+
+error:
+	close(pipe_fds[0]);
+	return ret;
+}
+
+// Returns:
+//   Whether cgroups created below 'cgroup_path' have the cpuset controller.
+static bool cpuset_enabled(const char *cgroup_path)
+{
+	char path[PATH_MAX];
+	char controllers[256] = "";
+
+	// cgroup v1: the hierarchy has it on every cgroup
+	snprintf(path, sizeof(path), "%s/cpuset.mems", cgroup_path);
+
+	if(access(path, F_OK) == 0)
+	{
+		return true;
+	}
+
+	// cgroup v2: the cgroup hands it down to its children
+	snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_path);
+	FILE *file = fopen(path, "r");
+
+	if(file != NULL)
+	{
+		if(fgets(controllers, sizeof(controllers), file) == NULL)
+		{
+			controllers[0] = 0;
+		}
+
+		fclose(file);
+	}
+
+	return strstr(controllers, "cpuset") != NULL;
+}
+
+static void usage(void)
+{
+	puts("USAGE: test_placement UID [CGROUP_PATH]");
+}
@@ -0,0 +1,29 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+// Usage: session_program exit CODE|sleep|remount
+// "remount" tries to make the root writable again and exits with 0 only if
+// that fails with EPERM.
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "exit";
+
+	if(strcmp(mode, "remount") == 0)
+	{
+		return mount(NULL, "/", NULL, MS_REMOUNT|MS_BIND, NULL) == -1 && errno == EPERM ? 0 : 1;
+	}
+
+	if(strcmp(mode, "sleep") == 0)
+	{
+		for(;;)
+		{
+			pause();
+		}
+	}
+
+	return argc > 2 ? atoi(argv[2]) : 0;
+}
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME       "protect_exec_session_test_cgroup"
+#define CGROUP_ROOT_PATH  ("/tmp/" CGROUP_NAME)
+#define CGROUP_CHILD_NAME "protect_exec_session"
+#define EXEC_PATH         "/session_program"
+#define ROOT_MNT_PATH     "/tmp/protect_exec_test_session_mnt"
+#define COMMANDS          16
+#define TIMEOUT_MS        200
+#define KILL_SLACK_MS     500
+#define PROBE_SOURCE      "protect_exec_session_probe"
+
+static int run_commands(struct protect_exec_session *session, struct protect_exec_opts *opts);
+static int run_cpu_timeout(struct protect_exec_session *session, struct protect_exec_opts *opts);
+static int run_lockdown(struct protect_exec_session *session, struct protect_exec_opts *opts,
+                        const char *cgroup_path);
+static int check_mountinfo(pid_t pid);
+static int run_timeout(struct protect_exec_session *session, struct protect_exec_opts *opts);
+static double elapsed_ms(const struct timespec *start);
+static int chdir_exec(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	char *cgroup_root_path;
+	char cgroup_path[PATH_MAX];
+	int ret = 1;
+
+	// UID must be specified as the first command-line argument
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	// Set the current working directory to the directory containing this
+	// executable.
+	if(chdir_exec())
+	{
+		log_err("Test failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	int cgroup_path_specified = argc > 2 && argv[2];
+
+	// If a second command-line argument has been given, treat that as a
+	// path to the root of an existing Control Group filesystem (v1 or v2).
+	// Otherwise, mount a new Control Group filesystem.
+	if(cgroup_path_specified)
+	{
+		cgroup_root_path = argv[2];
+	}
+	else
+	{
+		cgroup_root_path = CGROUP_ROOT_PATH;
+
+		if(mkdir(cgroup_root_path, 0755))
+		{
+			log_err("Test failed. mkdir(2) failed.");
+			log_err("mkdir(\"%s\", 0755)", cgroup_root_path);
+			goto error_0;
+		}
+
+		if(mount(CGROUP_NAME, cgroup_root_path, "cgroup", 0, "cpu"))
+		{
+			log_err("Test failed. mount(2) failed.");
+			log_err("mount(\"%s\", \"%s\", \"cgroup\", 0, \"cpu\")", CGROUP_NAME, cgroup_root_path);
+			goto error_1;
+		}
+	}
+
+	// Open the session in a child cgroup of its own, which it keeps for as
+	// long as it lives
+	snprintf(cgroup_path, sizeof(cgroup_path), "%s/%s", cgroup_root_path, CGROUP_CHILD_NAME);
+
+	if(mkdir(cgroup_path, 0755))
+	{
+		log_err("Test failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", cgroup_path);
+		goto error_2;
+	}
+
+	const char *mnt_path = ROOT_MNT_PATH;
+
+	// Calculate path of SquashFS filesystem.
+	char fs_path[PATH_MAX + sizeof("/root.sqsh")];
+	char cwd_path[PATH_MAX];
+	getcwd(cwd_path, sizeof(cwd_path));
+	snprintf(fs_path, sizeof(fs_path), "%s/root.sqsh", cwd_path);
+
+	if(mkdir(mnt_path, 0755))
+	{
+		log_err("Test failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", mnt_path);
+		goto error_3;
+	}
+
+	struct protect_exec_opts opts;
+	protect_exec_opts_init(&opts);
+	opts.uid = (uid_t) atoi(argv[1]);
+	opts.fs_path = fs_path;
+	opts.mnt_path = mnt_path;
+	opts.cgroup_path = cgroup_path;
+	opts.exec_path = EXEC_PATH;
+
+	struct protect_exec_session *session = protect_exec_session_open(&opts);
+
+	if(session == NULL)
+	{
+		log_err("Test failed. protect_exec_session_open(3) failed.");
+		goto error_4;
+	}
+
+	int failed = run_commands(session, &opts);
+	failed |= run_cpu_timeout(session, &opts);
+	failed |= run_lockdown(session, &opts, cgroup_path);
+	failed |= run_timeout(session, &opts);
+
+	protect_exec_session_close(session);
+	protect_exec_drain();
+
+	if(!failed)
+	{
+		ret = 0;
+	}
+
+error_4:
+	if(rmdir(mnt_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", mnt_path);
+	}
+error_3:
+	if(rmdir(cgroup_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", cgroup_path);
+	}
+error_2:
+	if(!cgroup_path_specified && umount2(cgroup_root_path, MNT_DETACH))
+	{
+		log_err("umount2(2) failed.");
+		log_err("umount2(\"%s\", MNT_DETACH)", cgroup_root_path);
+	}
+error_1:
+	if(!cgroup_path_specified && rmdir(cgroup_root_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", cgroup_root_path);
+	}
+error_0:
+	return ret;
+}
+
+// Description:
+//   Run COMMANDS commands in the session, each exiting with a code of its
+//   own, and check that every status comes back to the right command.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_commands(struct protect_exec_session *session, struct protect_exec_opts *opts)
+{
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_result result;
+	struct timespec start;
+	char code[16];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(int i = 0; i < COMMANDS; i++)
+	{
+		snprintf(code, sizeof(code), "%d", i);
+
+		char *const exec_argv[] = { EXEC_PATH, "exit", code, NULL };
+		opts->argv = exec_argv;
+		opts->envp = exec_envp;
+
+		if(protect_exec_session_run(session, opts, &result))
+		{
+			log_err("Test failed. protect_exec_session_run(3) failed. (command: %d)", i);
+			return -1;
+		}
+
+		if(!WIFEXITED(result.status) || WEXITSTATUS(result.status) != i)
+		{
+			log_err("Test failed. Unexpected status. (command: %d, status: %#x)", i, result.status);
+			return -1;
+		}
+	}
+
+	log_info("Ran %d commands in one session, %.3f ms per command.", COMMANDS, elapsed_ms(&start) / COMMANDS);
+
+	return 0;
+}
+
+// Description:
+//   Check that a command asking for a CPU time limit, which sessions do not
+//   enforce, is refused with EINVAL, and that the session still runs
+//   commands afterwards.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_cpu_timeout(struct protect_exec_session *session, struct protect_exec_opts *opts)
+{
+	char *const exec_argv[] = { EXEC_PATH, "exit", "7", NULL };
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_result result;
+
+	opts->argv = exec_argv;
+	opts->envp = exec_envp;
+	opts->cpu_timeout_ms = TIMEOUT_MS;
+
+	int ret = protect_exec_session_run(session, opts, &result);
+
+	opts->cpu_timeout_ms = 0;
+
+	if(ret == 0 || errno != EINVAL)
+	{
+		log_err("Test failed. Command with a CPU time limit was not refused with EINVAL.");
+		return -1;
+	}
+
+	if(protect_exec_session_run(session, opts, &result))
+	{
+		log_err("Test failed. protect_exec_session_run(3) failed after a refused command.");
+		return -1;
+	}
+
+	if(!WIFEXITED(result.status) || WEXITSTATUS(result.status) != 7)
+	{
+		log_err("Test failed. Unexpected status. (status: %#x)", result.status);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Mount a tmpfs over the session's root on the host, and check from the
+//   mount table of the live session that it never shows up there and that
+//   every mount of the sandbox is read-only, nosuid and nodev. Then check
+//   that a command cannot remount the root.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_lockdown(struct protect_exec_session *session, struct protect_exec_opts *opts,
+                        const char *cgroup_path)
+{
+	char *const exec_argv[] = { EXEC_PATH, "remount", NULL };
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_result result;
+	char procs_path[PATH_MAX + sizeof("/cgroup.procs")];
+	int ret = -1;
+
+	// Between commands, the stub is the only process of the session cgroup
+	snprintf(procs_path, sizeof(procs_path), "%s/cgroup.procs", cgroup_path);
+	FILE *procs = fopen(procs_path, "r");
+	int stub_pid = 0;
+
+	if(procs == NULL || fscanf(procs, "%d", &stub_pid) != 1)
+	{
+		log_err("Test failed. Could not find the session stub in \"%s\".", procs_path);
+
+		if(procs != NULL)
+		{
+			fclose(procs);
+		}
+
+		return -1;
+	}
+
+	fclose(procs);
+
+	if(mount(PROBE_SOURCE, opts->mnt_path, "tmpfs", 0, NULL))
+	{
+		log_err("Test failed. mount(2) failed.");
+		log_err("mount(\"%s\", \"%s\", \"tmpfs\", 0, NULL)", PROBE_SOURCE, opts->mnt_path);
+		return -1;
+	}
+
+	if(check_mountinfo((pid_t) stub_pid))
+	{
+		goto error;
+	}
+
+	opts->argv = exec_argv;
+	opts->envp = exec_envp;
+
+	if(protect_exec_session_run(session, opts, &result))
+	{
+		log_err("Test failed. protect_exec_session_run(3) failed. (command: remount)");
+		goto error;
+	}
+
+	if(!WIFEXITED(result.status) || WEXITSTATUS(result.status) != 0)
+	{
+		log_err("Test failed. Remounting the sandbox root did not fail with EPERM. (status: %#x)", result.status);
+		goto error;
+	}
+
+	log_info("Host mount stayed out of the session; its mounts are locked down.");
+	ret = 0;
+
+error:
+	if(umount2(opts->mnt_path, MNT_DETACH))
+	{
+		log_err("umount2(2) failed.");
+		log_err("umount2(\"%s\", MNT_DETACH)", opts->mnt_path);
+	}
+
+	return ret;
+}
+
+// Description:
+//   Read the mount table of process 'pid' and check that it has no probe
+//   mount and that every mount is read-only, nosuid and nodev.
+// Returns:
+//   0 on success, -1 on failure.
+static int check_mountinfo(pid_t pid)
+{
+	char mountinfo_path[32];
+	char line[4096];
+	int mounts = 0;
+	int ret = 0;
+
+	snprintf(mountinfo_path, sizeof(mountinfo_path), "/proc/%d/mountinfo", pid);
+	FILE *mountinfo = fopen(mountinfo_path, "r");
+
+	if(mountinfo == NULL)
+	{
+		log_err("Test failed. fopen(3) failed.");
+		log_err("fopen(\"%s\", \"r\")", mountinfo_path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), mountinfo) != NULL)
+	{
+		char mount_point[PATH_MAX];
+		char options[256];
+		char options_list[258];
+
+		// ID, parent ID, device, root, mount point, per-mount options
+		if(sscanf(line, "%*d %*d %*s %*s %4095s %255s", mount_point, options) != 2)
+		{
+			log_err("Test failed. Unexpected line in \"%s\". (line: \"%s\")", mountinfo_path, line);
+			ret = -1;
+			break;
+		}
+
+		mounts++;
+		snprintf(options_list, sizeof(options_list), ",%s,", options);
+
+		if(strstr(line, PROBE_SOURCE) != NULL)
+		{
+			log_err("Test failed. A host mount made after the session opened shows up in it. (mount point: \"%s\")", mount_point);
+			ret = -1;
+		}
+
+		if(strstr(options_list, ",ro,") == NULL || strstr(options_list, ",nosuid,") == NULL ||
+		   strstr(options_list, ",nodev,") == NULL)
+		{
+			log_err("Test failed. Sandbox mount is not locked down. (mount point: \"%s\", options: \"%s\")", mount_point, options);
+			ret = -1;
+		}
+	}
+
+	fclose(mountinfo);
+
+	if(ret == 0 && mounts == 0)
+	{
+		log_err("Test failed. No mounts in \"%s\".", mountinfo_path);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+// Description:
+//   Run a command that outlives its wall-clock limit, and check that it is
+//   killed in time and that the session refuses commands afterwards.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_timeout(struct protect_exec_session *session, struct protect_exec_opts *opts)
+{
+	char *const exec_argv[] = { EXEC_PATH, "sleep", NULL };
+	char *const exec_envp[] = { NULL };
+	struct protect_exec_result result;
+	struct timespec start;
+
+	opts->argv = exec_argv;
+	opts->envp = exec_envp;
+	opts->wall_timeout_ms = TIMEOUT_MS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(protect_exec_session_run(session, opts, &result))
+	{
+		log_err("Test failed. protect_exec_session_run(3) failed. (command: sleep)");
+		return -1;
+	}
+
+	double elapsed = elapsed_ms(&start);
+
+	log_info("Mode 'sleep': deadline %d, status %#x, %.1f ms.", result.deadline_exceeded, result.status, elapsed);
+
+	if(result.deadline_exceeded != PROTECT_EXEC_DEADLINE_WALL || !WIFSIGNALED(result.status))
+	{
+		log_err("Test failed. Command was not killed for its wall-clock limit.");
+		return -1;
+	}
+
+	if(elapsed > TIMEOUT_MS + KILL_SLACK_MS)
+	{
+		log_err("Test failed. Took longer than %d ms.", TIMEOUT_MS + KILL_SLACK_MS);
+		return -1;
+	}
+
+	if(protect_exec_session_run(session, opts, &result) == 0)
+	{
+		log_err("Test failed. Killed session accepted another command.");
+		return -1;
+	}
+
+	return 0;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void usage(void)
+{
+	puts("USAGE: test_session UID [CGROUP_PATH]");
+}
+
+// Description:
+//   Change the current working directory to the directory containing the
+//   current process' executable.
+// Returns:
+//   0 on success, -1 on failure.
+static int chdir_exec(void)
+{
+	char program_path[4096];
+	ssize_t program_path_size = readlink("/proc/self/exe", program_path, sizeof(program_path) - 1);
+
+	if(program_path_size == -1)
+	{
+		debug("readlink(2) failed.");
+		debug("readlink(\"/proc/self/exe\", program_path, sizeof(program_path))");
+		return -1;
+	}
+
+	program_path[program_path_size] = 0;
+
+	if(chdir(dirname(program_path)))
+	{
+		debug("chdir(2) failed.");
+		debug("chdir(\"%s\")", program_path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+# Plot the throughput samples written by test_soak:
+#   gnuplot -e "csv='soak_throughput.csv'" plot_throughput.gp > soak_throughput.png
+if (!exists("csv")) csv = 'soak_throughput.csv'
+
+set terminal png size 1200,600
+set datafile separator ','
+set key autotitle columnhead
+set xlabel 'Elapsed time (s)'
+set ylabel 'Launches per second'
+set yrange [0:*]
+set grid
+
+plot csv using 1:($2 == 0 ? $4 : 1/0) with linespoints title 'no injection', \
+     csv using 1:($2 != 0 ? $4 : 1/0) with points title 'injected failure'
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "fault.h"
+#include "harness.h"
+#include "protect_exec.h"
+
+#define CGROUP_NAME        "protect_exec_soak_test_cgroup"
+#define CGROUP_CHILD_NAME  "protect_exec_soak"
+#define EXEC_PATH          "/soak_program"
+#define ROOT_MNT_PATH      "/tmp/protect_exec_test_soak_mnt"
+#define THROUGHPUT_CSV     "soak_throughput.csv"
+#define DEFAULT_ITERATIONS 100000
+#define INJECTABLE_STEPS   8
+#define SAMPLE_INTERVAL    1.0
+#define SETTLE_ATTEMPTS    100
+#define WALL_TIMEOUT_MS    10000
+
+// Resources that a launch must give back once it has been reaped and its
+// teardown drained.
+struct census {
+	long fds;
+	long mounts;
+	long loops;
+	long cgroup_procs;
+	long cgroup_leaves;
+	long unreaped_children;
+};
+
+struct phase_stats {
+	long launched;
+	long succeeded;
+};
+
+static int run_phase(int step, long iterations, const struct protect_exec_opts *opts,
+                     FILE *csv, const struct timespec *start, struct phase_stats *stats);
+static int census_take(struct census *census, const char *cgroup_path);
+static int census_settle(const struct census *before, struct census *after,
+                         const char *cgroup_path);
+static int census_report(int step, const struct census *before, const struct census *after);
+static long count_dir_entries(const char *path);
+static long count_bound_loops(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	struct harness_cgroup cgroup;
+	int ret = 1;
+
+	// UID must be specified as the first command-line argument
+	if(argc < 2)
+	{
+		log_err("UID not specified in command-line arguments.");
+		usage();
+		goto error_0;
+	}
+
+	// Set the current working directory to the directory containing this
+	// executable.
+	if(harness_chdir_exec())
+	{
+		log_err("Test failed. Could not make the current working directory match the current executable's directory.");
+		goto error_0;
+	}
+
+	long iterations = argc > 2 ? atol(argv[2]) : DEFAULT_ITERATIONS;
+
+	if(iterations < INJECTABLE_STEPS)
+	{
+		log_err("ITERATIONS must be at least %d.", INJECTABLE_STEPS);
+		usage();
+		goto error_0;
+	}
+
+	// If a third command-line argument has been given, treat that as a path
+	// to the root of an existing Control Group filesystem. Otherwise, mount a
+	// new Control Group filesystem. Launch into a dedicated child cgroup, so
+	// that its membership can be expected to drop back to zero after every
+	// phase.
+	if(harness_cgroup_open(&cgroup, argc > 3 ? argv[3] : NULL, CGROUP_NAME, "cpu", CGROUP_CHILD_NAME))
+	{
+		log_err("Test failed. Could not set up a cgroup.");
+		goto error_0;
+	}
+
+	const char *cgroup_path = cgroup.path;
+
+	const char *mnt_path = ROOT_MNT_PATH;
+	const char *exec_path = EXEC_PATH;
+	char *const exec_argv[] = { (char *const) exec_path, NULL };
+	char *const exec_envp[] = { NULL };
+
+	// Calculate path of SquashFS filesystem.
+	char fs_path[PATH_MAX];
+	harness_image_path(fs_path, sizeof(fs_path));
+
+	if(mkdir(mnt_path, 0755))
+	{
+		log_err("Test failed. mkdir(2) failed.");
+		log_err("mkdir(\"%s\", 0755)", mnt_path);
+		goto error_1;
+	}
+
+	FILE *csv = fopen(THROUGHPUT_CSV, "w");
+
+	if(csv == NULL)
+	{
+		log_err("Test failed. fopen(3) failed.");
+		log_err("fopen(\"%s\", \"w\")", THROUGHPUT_CSV);
+		goto error_2;
+	}
+
+	fprintf(csv, "elapsed_s,step,launches,launches_per_s\n");
+
+	struct protect_exec_opts opts;
+	protect_exec_opts_init(&opts);
+	opts.uid = (uid_t) atoi(argv[1]);
+	opts.fs_path = fs_path;
+	opts.mnt_path = mnt_path;
+	opts.cgroup_path = cgroup_path;
+	opts.exec_path = exec_path;
+	opts.argv = exec_argv;
+	opts.envp = exec_envp;
+
+	// A generous time limit never fires, but has every launch create and
+	// remove a leaf cgroup of its own
+	opts.wall_timeout_ms = WALL_TIMEOUT_MS;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Phase 0 launches cleanly; phase N fails step N of protect_exec(3) on
+	// every launch. Each phase must give back everything it acquired.
+	int leaked = 0;
+
+	for(int step = 0; step <= INJECTABLE_STEPS; step++)
+	{
+		long phase_iterations = step == 0 ? iterations : iterations / INJECTABLE_STEPS;
+		struct census before;
+		struct census after;
+		struct phase_stats stats;
+
+		if(census_take(&before, cgroup_path))
+		{
+			log_err("Test failed. Could not take resource census.");
+			goto error_3;
+		}
+
+		if(run_phase(step, phase_iterations, &opts, csv, &start, &stats))
+		{
+			log_err("Test failed. Could not run phase %d.", step);
+			goto error_3;
+		}
+
+		if(census_settle(&before, &after, cgroup_path))
+		{
+			log_err("Test failed. Could not take resource census.");
+			goto error_3;
+		}
+
+		log_info("Step %d: %ld launches, %ld succeeded.", step, stats.launched, stats.succeeded);
+
+		if(step == 0 && stats.succeeded != stats.launched)
+		{
+			log_err("Test failed. %ld launches failed without injected failures.", stats.launched - stats.succeeded);
+			leaked = 1;
+		}
+
+		leaked |= census_report(step, &before, &after);
+	}
+
+	log_info("Throughput samples written to \"%s\".", THROUGHPUT_CSV);
+
+	if(!leaked)
+	{
+		ret = 0;
+	}
+
+error_3:
+	fclose(csv);
+error_2:
+	protect_exec_drain();
+
+	if(rmdir(mnt_path))
+	{
+		log_err("rmdir(2) failed.");
+		log_err("rmdir(\"%s\")", mnt_path);
+	}
+error_1:
+	harness_cgroup_close(&cgroup);
+error_0:
+	return ret;
+}
+
+// Description:
+//   Launch 'iterations' times with failure injected at 'step' (0 for none),
+//   appending a throughput sample to 'csv' every SAMPLE_INTERVAL seconds.
+//   Library debug output is discarded unless SOAK_VERBOSE is set.
+// Returns:
+//   0 on success, -1 on failure.
+static int run_phase(int step, long iterations, const struct protect_exec_opts *opts,
+                     FILE *csv, const struct timespec *start, struct phase_stats *stats)
+{
+	int saved_stderr = -1;
+
+	if(getenv("SOAK_VERBOSE") == NULL)
+	{
+		int null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+		saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+
+		if(null_fd == -1 || saved_stderr == -1 || dup2(null_fd, STDERR_FILENO) == -1)
+		{
+			log_err("Could not silence stderr.");
+			return -1;
+		}
+
+		close(null_fd);
+	}
+
+	stats->launched = 0;
+	stats->succeeded = 0;
+	protect_exec_fault_step = step;
+
+	double sample_time = harness_elapsed_ms(start) / 1e3;
+	long sample_launches = 0;
+
+	for(long i = 0; i < iterations; i++)
+	{
+		struct protect_exec_result result;
+
+		if(protect_exec_ex(opts, &result) == 0 && WIFEXITED(result.status) && WEXITSTATUS(result.status) == 0)
+		{
+			stats->succeeded++;
+		}
+
+		// Every launch reuses mnt_path. Drain before the next one, so that
+		// the soak covers complete launch and teardown cycles rather than
+		// how far teardown falls behind a tight loop.
+		protect_exec_drain();
+
+		stats->launched++;
+		sample_launches++;
+
+		double now = harness_elapsed_ms(start) / 1e3;
+
+		if(now - sample_time >= SAMPLE_INTERVAL || i == iterations - 1)
+		{
+			fprintf(csv, "%.3f,%d,%ld,%.1f\n", now, step, sample_launches, sample_launches / (now - sample_time));
+			fflush(csv);
+			sample_time = now;
+			sample_launches = 0;
+		}
+	}
+
+	protect_exec_fault_step = 0;
+
+	if(saved_stderr != -1)
+	{
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+	}
+
+	return 0;
+}
+
+// Returns:
+//   0 on success, -1 on failure.
+static int census_take(struct census *census, const char *cgroup_path)
+{
+	siginfo_t info;
+
+	// Discount the descriptor opendir(3) itself holds
+	census->fds = count_dir_entries("/proc/self/fd") - 1;
+	census->mounts = harness_count_lines("/proc/self/mountinfo");
+	census->loops = count_bound_loops();
+	census->cgroup_procs = 0;
+	census->cgroup_leaves = 0;
+
+	info.si_pid = 0;
+	census->unreaped_children = waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT) == 0 && info.si_pid != 0;
+
+	if(census->fds < 0 || census->mounts < 0 || census->loops < 0 ||
+	   harness_count_cgroup_tree(cgroup_path, &census->cgroup_procs, &census->cgroup_leaves))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+// Description:
+//   Take the post-phase census. Mounts held by an exited sandbox's namespace,
+//   and the autoclearing loopback devices under them, are released
+//   asynchronously by the kernel, so growth is only final once it persists
+//   for SETTLE_ATTEMPTS polls.
+// Returns:
+//   0 on success, -1 on failure.
+static int census_settle(const struct census *before, struct census *after,
+                         const char *cgroup_path)
+{
+	for(int attempt = 0; attempt < SETTLE_ATTEMPTS; attempt++)
+	{
+		if(census_take(after, cgroup_path))
+		{
+			return -1;
+		}
+
+		if(after->fds <= before->fds && after->mounts <= before->mounts &&
+		   after->loops <= before->loops && after->cgroup_procs <= before->cgroup_procs &&
+		   after->cgroup_leaves <= before->cgroup_leaves &&
+		   after->unreaped_children <= before->unreaped_children)
+		{
+			break;
+		}
+
+		usleep(10000);
+	}
+
+	return 0;
+}
+
+// Description:
+//   Log every resource that grew over a phase.
+// Returns:
+//   1 if anything leaked, 0 otherwise.
+static int census_report(int step, const struct census *before, const struct census *after)
+{
+	int leaked = 0;
+
+#define CENSUS_CHECK(field, name) \
+	if(after->field > before->field) \
+	{ \
+		log_err("Step %d leaked %ld %s. (before: %ld, after: %ld)", step, \
+			after->field - before->field, name, before->field, after->field); \
+		leaked = 1; \
+	}
+
+	CENSUS_CHECK(fds, "file descriptors");
+	CENSUS_CHECK(mounts, "mounts");
+	CENSUS_CHECK(loops, "loopback devices");
+	CENSUS_CHECK(cgroup_procs, "cgroup processes");
+	CENSUS_CHECK(cgroup_leaves, "leaf cgroups");
+	CENSUS_CHECK(unreaped_children, "unreaped children");
+
+#undef CENSUS_CHECK
+
+	return leaked;
+}
+
+// Returns:
+//   Number of entries in the directory besides "." and "..", -1 on failure.
+static long count_dir_entries(const char *path)
+{
+	DIR *dir = opendir(path);
+
+	if(dir == NULL)
+	{
+		log_err("opendir(3) failed.");
+		log_err("opendir(\"%s\")", path);
+		return -1;
+	}
+
+	long entries = 0;
+	struct dirent *de;
+
+	while((de = readdir(dir)))
+	{
+		entries += strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+	}
+
+	closedir(dir);
+
+	return entries;
+}
+
+// Returns:
+//   Number of loopback devices on the host with a backing file, -1 on
+//   failure.
+static long count_bound_loops(void)
+{
+	DIR *dir = opendir("/sys/block");
+
+	if(dir == NULL)
+	{
+		log_err("opendir(3) failed.");
+		log_err("opendir(\"/sys/block\")");
+		return -1;
+	}
+
+	long loops = 0;
+	struct dirent *de;
+	char backing_path[PATH_MAX];
+
+	while((de = readdir(dir)))
+	{
+		if(strncmp(de->d_name, "loop", 4))
+		{
+			continue;
+		}
+
+		snprintf(backing_path, sizeof(backing_path), "/sys/block/%s/loop/backing_file", de->d_name);
+		loops += access(backing_path, F_OK) == 0;
+	}
+
+	closedir(dir);
+
+	return loops;
+}
+
+static void usage(void)
+{
+	puts("USAGE: test_soak UID [ITERATIONS [CGROUP_PATH]]");
+}
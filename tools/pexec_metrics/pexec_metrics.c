@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "metrics.h"
+
+static const struct metrics_segment *segment_open(const char *shm_name);
+static void write_counter(FILE *out, const char *name, const char *help, const char *labels, uint64_t value);
+static void write_gauge(FILE *out, const char *name, const char *help, int64_t value);
+static void write_histogram(FILE *out, const char *name, const char *help,
+                            const struct metrics_segment *metrics,
+                            const struct metrics_histogram *histogram);
+static uint64_t load(const uint64_t *counter);
+static void usage(void);
+
+// pexec_metrics(8): print the launch metrics published by every process
+// linking libpexec in the Prometheus text exposition format, to stdout or,
+// atomically, to OUTPUT_PATH for a textfile collector. The segment is only
+// read, so launches are never held up.
+int main(int argc, char **argv)
+{
+	const char *shm_name = METRICS_SHM_NAME;
+	const char *output_path = NULL;
+	char tmp_path[PATH_MAX];
+	int opt;
+	int ret = 1;
+
+	while((opt = getopt(argc, argv, "n:o:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n':
+			shm_name = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			usage();
+			goto error_0;
+		}
+	}
+
+	const struct metrics_segment *metrics = segment_open(shm_name);
+
+	if(metrics == NULL)
+	{
+		log_err("Could not read metrics segment \"%s\".", shm_name);
+		goto error_0;
+	}
+
+	FILE *out = stdout;
+
+	if(output_path != NULL)
+	{
+		snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output_path);
+		out = fopen(tmp_path, "w");
+
+		if(out == NULL)
+		{
+			log_err("fopen(3) failed.");
+			log_err("fopen(\"%s\", \"w\")", tmp_path);
+			goto error_1;
+		}
+	}
+
+	char labels[32];
+
+	write_counter(out, "pexec_launches_total", "Launches started by protect_exec(3).", NULL, load(&metrics->launches));
+
+	for(int step = 0; step < METRICS_STEPS; step++)
+	{
+		snprintf(labels, sizeof(labels), "step=\"%d\"", step);
+		write_counter(out, "pexec_launch_failures_total",
+			step == 0 ? "Launches failed, by step of protect_exec(3)." : NULL, labels, load(&metrics->failures[step]));
+	}
+
+	write_counter(out, "pexec_deadline_exceeded_total", "Sandboxes killed for exceeding a time limit.",
+		"limit=\"wall\"", load(&metrics->deadlines_exceeded[1]));
+	write_counter(out, "pexec_deadline_exceeded_total", NULL,
+		"limit=\"cpu\"", load(&metrics->deadlines_exceeded[2]));
+
+	write_gauge(out, "pexec_sandboxes_active", "Sandboxes whose program is running.",
+		__atomic_load_n(&metrics->sandboxes_active, __ATOMIC_RELAXED));
+	write_gauge(out, "pexec_loop_devices_in_use", "Loopback devices bound to a sandbox image.",
+		__atomic_load_n(&metrics->loops_in_use, __ATOMIC_RELAXED));
+
+	write_histogram(out, "pexec_setup_latency_seconds", "Time from the start of a launch until its program is executing.",
+		metrics, &metrics->setup_latency);
+	write_histogram(out, "pexec_teardown_latency_seconds", "Time from the end of a launch until its mount and loopback device are released.",
+		metrics, &metrics->teardown_latency);
+
+	if(output_path != NULL)
+	{
+		if(fclose(out) || rename(tmp_path, output_path))
+		{
+			log_err("Could not write \"%s\".", output_path);
+			unlink(tmp_path);
+			goto error_1;
+		}
+	}
+	else
+	{
+		fflush(out);
+	}
+
+	ret = 0;
+
+error_1:
+	munmap((void *) metrics, sizeof(*metrics));
+error_0:
+	return ret;
+}
+
+// Description:
+//   Map the metrics segment read-only and check its header.
+// Returns:
+//   The mapped segment, or NULL on failure.
+static const struct metrics_segment *segment_open(const char *shm_name)
+{
+	int fd = shm_open(shm_name, O_RDONLY|O_CLOEXEC, 0);
+
+	if(fd == -1)
+	{
+		debug("shm_open(3) failed. (errno: %s)", clean_errno());
+		debug("shm_open(\"%s\", O_RDONLY|O_CLOEXEC, 0)", shm_name);
+		return NULL;
+	}
+
+	struct stat st;
+
+	if(fstat(fd, &st) || (size_t) st.st_size != sizeof(struct metrics_segment))
+	{
+		debug("Metrics segment has an unexpected size. (size: %lld, expected: %zu)",
+			(long long) st.st_size, sizeof(struct metrics_segment));
+		close(fd);
+		return NULL;
+	}
+
+	const struct metrics_segment *metrics = mmap(NULL, sizeof(*metrics), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(metrics == MAP_FAILED)
+	{
+		debug("mmap(2) failed. (errno: %s)", clean_errno());
+		return NULL;
+	}
+
+	uint32_t magic = __atomic_load_n(&metrics->magic, __ATOMIC_RELAXED);
+	uint32_t version = __atomic_load_n(&metrics->version, __ATOMIC_ACQUIRE);
+
+	if(magic != METRICS_MAGIC || version != METRICS_VERSION)
+	{
+		debug("Metrics segment has an unexpected layout. (magic: %x, version: %u)", magic, version);
+		munmap((void *) metrics, sizeof(*metrics));
+		return NULL;
+	}
+
+	return metrics;
+}
+
+// Description:
+//   Write one sample of a counter, preceded by its HELP and TYPE lines
+//   unless 'help' is NULL.
+static void write_counter(FILE *out, const char *name, const char *help, const char *labels, uint64_t value)
+{
+	if(help != NULL)
+	{
+		fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	}
+
+	if(labels != NULL)
+	{
+		fprintf(out, "%s{%s} %llu\n", name, labels, (unsigned long long) value);
+	}
+	else
+	{
+		fprintf(out, "%s %llu\n", name, (unsigned long long) value);
+	}
+}
+
+static void write_gauge(FILE *out, const char *name, const char *help, int64_t value)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, (long long) value);
+}
+
+// Description:
+//   Write a histogram with cumulative buckets. '_count' is the sum of the
+//   buckets as read, so that it agrees with them even while launches are
+//   updating the segment.
+static void write_histogram(FILE *out, const char *name, const char *help,
+                            const struct metrics_segment *metrics,
+                            const struct metrics_histogram *histogram)
+{
+	uint64_t cumulative = 0;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+	for(int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+	{
+		uint64_t bound_us = load(&metrics->bounds_us[i]);
+		cumulative += load(&histogram->counts[i]);
+
+		if(bound_us == UINT64_MAX)
+		{
+			fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) cumulative);
+		}
+		else
+		{
+			fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, bound_us / 1e6, (unsigned long long) cumulative);
+		}
+	}
+
+	fprintf(out, "%s_sum %.6f\n", name, load(&histogram->sum_us) / 1e6);
+	fprintf(out, "%s_count %llu\n", name, (unsigned long long) cumulative);
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void usage(void)
+{
+	puts("USAGE: pexec_metrics [-n SHM_NAME] [-o OUTPUT_PATH]");
+}
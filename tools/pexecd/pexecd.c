@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dbg.h"
+#include "protect_exec.h"
+#include "proto.h"
+
+// Mount path of a launch in progress
+struct mount_claim {
+	const char *mnt_path;
+	struct mount_claim *next;
+};
+
+static void *serve_connection(void *data);
+static int authorize_request(int conn_fd, struct pexec_proto_request *req, int *fs_fd,
+                             char fs_fd_path[32], char mnt_path[PATH_MAX]);
+static int authorize_cgroup(struct pexec_proto_request *req);
+static int mount_claim(struct mount_claim *claim, const char *mnt_path);
+static void mount_unclaim(struct mount_claim *claim);
+static bool uid_allowed(uid_t peer_uid, uid_t uid);
+static bool path_within(const char *dir, const char *path);
+static int listen_socket(const char *socket_path, gid_t gid);
+static void on_shutdown_signal(int signum);
+static void usage(void);
+
+static volatile sig_atomic_t shutdown_requested = 0;
+
+// Directories, resolved at startup, that every requested image, mount path
+// and cgroup must lie within, and the UIDs any client may request besides its
+// own.
+static char image_dir[PATH_MAX];
+static char mount_dir[PATH_MAX];
+static char cgroup_dir[PATH_MAX];
+static uid_t allowed_uids[PEXECD_MAX_ALLOWED_UIDS];
+static int allowed_uid_count = 0;
+
+// Connections still being served; shutdown waits for them to finish.
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+static int active_connections = 0;
+
+// Mount paths of the launches in progress. Two launches on one mount path
+// would mount over each other's root.
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mount_claim *mount_claims = NULL;
+
+// pexecd(8): accept launch requests on a Unix socket and perform them with
+// protect_exec_ex(3). Every connection carries exactly one request and is
+// served by its own thread, so all launches share this process' state.
+int main(int argc, char **argv)
+{
+	const char *socket_path = PEXECD_SOCKET_PATH;
+	const char *image_dir_arg = NULL;
+	const char *mount_dir_arg = NULL;
+	const char *cgroup_dir_arg = NULL;
+	gid_t gid = (gid_t) -1;
+	int opt;
+	int ret = 1;
+
+	while((opt = getopt(argc, argv, "s:g:i:m:c:u:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'g':
+			gid = (gid_t) atoi(optarg);
+			break;
+		case 'i':
+			image_dir_arg = optarg;
+			break;
+		case 'm':
+			mount_dir_arg = optarg;
+			break;
+		case 'c':
+			cgroup_dir_arg = optarg;
+			break;
+		case 'u':
+			if(allowed_uid_count == PEXECD_MAX_ALLOWED_UIDS)
+			{
+				log_err("At most %d UIDs may be allowed.", PEXECD_MAX_ALLOWED_UIDS);
+				goto error_0;
+			}
+
+			allowed_uids[allowed_uid_count++] = (uid_t) atoi(optarg);
+			break;
+		default:
+			usage();
+			goto error_0;
+		}
+	}
+
+	if(image_dir_arg == NULL || mount_dir_arg == NULL || cgroup_dir_arg == NULL)
+	{
+		usage();
+		goto error_0;
+	}
+
+	if(realpath(image_dir_arg, image_dir) == NULL || realpath(mount_dir_arg, mount_dir) == NULL ||
+	   realpath(cgroup_dir_arg, cgroup_dir) == NULL)
+	{
+		log_err("Could not resolve the image, mount or cgroup directory.");
+		goto error_0;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_shutdown_signal;
+	sigemptyset(&sa.sa_mask);
+
+	// No SA_RESTART so that accept(2) returns EINTR on shutdown
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	sigset_t all_signals;
+	sigfillset(&all_signals);
+
+	int listen_fd = listen_socket(socket_path, gid);
+
+	if(listen_fd == -1)
+	{
+		log_err("Could not listen on \"%s\".", socket_path);
+		goto error_0;
+	}
+
+	log_info("Listening on \"%s\".", socket_path);
+
+	while(!shutdown_requested)
+	{
+		int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if(conn_fd == -1)
+		{
+			if(errno != EINTR)
+			{
+				log_warn("accept4(2) failed.");
+			}
+
+			continue;
+		}
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		sigset_t old_signals;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		pthread_mutex_lock(&active_lock);
+		active_connections++;
+		pthread_mutex_unlock(&active_lock);
+
+		// Connection threads inherit a full signal mask, so that shutdown
+		// signals always interrupt accept(2) on this thread.
+		pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+		int err = pthread_create(&thread, &attr, serve_connection, (void *) (intptr_t) conn_fd);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+		pthread_attr_destroy(&attr);
+
+		if(err)
+		{
+			errno = err;
+			log_warn("pthread_create(3) failed.");
+			close(conn_fd);
+
+			pthread_mutex_lock(&active_lock);
+			active_connections--;
+			pthread_mutex_unlock(&active_lock);
+		}
+	}
+
+	log_info("Shutting down.");
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	pthread_mutex_lock(&active_lock);
+
+	while(active_connections > 0)
+	{
+		pthread_cond_wait(&active_cond, &active_lock);
+	}
+
+	pthread_mutex_unlock(&active_lock);
+
+	// Finish unmounting and releasing loopback devices of every launch
+	protect_exec_drain();
+
+	ret = 0;
+
+error_0:
+	return ret;
+}
+
+// Description:
+//   Read a single launch request from a connection, perform it and reply with
+//   its outcome. A request for a mount path that another launch is using
+//   fails with EBUSY.
+static void *serve_connection(void *data)
+{
+	int conn_fd = (int) (intptr_t) data;
+	struct pexec_proto_request req;
+	struct protect_exec_result result;
+	struct mount_claim claim;
+	char fs_fd_path[32];
+	char mnt_path[PATH_MAX];
+	int fs_fd = -1;
+	int ret = -1;
+	int error;
+
+	memset(&result, 0, sizeof(result));
+
+	if(pexec_proto_recv_request(conn_fd, &req))
+	{
+		debug("Dropping connection with invalid launch request. (errno: %s)", clean_errno());
+		goto done;
+	}
+
+	if(authorize_request(conn_fd, &req, &fs_fd, fs_fd_path, mnt_path) ||
+	   mount_claim(&claim, mnt_path))
+	{
+		error = errno;
+	}
+	else
+	{
+		ret = protect_exec_ex(&req.opts, &result);
+		error = errno;
+		mount_unclaim(&claim);
+	}
+
+	if(pexec_proto_send_response(conn_fd, ret, error, &result))
+	{
+		debug("Could not deliver launch response. (errno: %s)", clean_errno());
+	}
+
+	if(fs_fd != -1)
+	{
+		close(fs_fd);
+	}
+
+	pexec_proto_request_free(&req);
+
+done:
+	close(conn_fd);
+
+	pthread_mutex_lock(&active_lock);
+
+	if(--active_connections == 0)
+	{
+		pthread_cond_broadcast(&active_cond);
+	}
+
+	pthread_mutex_unlock(&active_lock);
+
+	return NULL;
+}
+
+// Description:
+//   Record that a launch is using 'mnt_path' until mount_unclaim().
+// Returns:
+//   0 on success, -1 with errno set to EBUSY if another launch is using it.
+static int mount_claim(struct mount_claim *claim, const char *mnt_path)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mount_lock);
+
+	for(struct mount_claim *other = mount_claims; other != NULL; other = other->next)
+	{
+		if(!strcmp(other->mnt_path, mnt_path))
+		{
+			debug("Refusing mount path \"%s\" in use by another launch.", mnt_path);
+			errno = EBUSY;
+			ret = -1;
+			break;
+		}
+	}
+
+	if(ret == 0)
+	{
+		claim->mnt_path = mnt_path;
+		claim->next = mount_claims;
+		mount_claims = claim;
+	}
+
+	pthread_mutex_unlock(&mount_lock);
+
+	return ret;
+}
+
+static void mount_unclaim(struct mount_claim *claim)
+{
+	pthread_mutex_lock(&mount_lock);
+
+	struct mount_claim **link = &mount_claims;
+
+	while(*link != claim)
+	{
+		link = &(*link)->next;
+	}
+
+	*link = claim->next;
+
+	pthread_mutex_unlock(&mount_lock);
+}
+
+// Description:
+//   Check a request against the credentials of the client that sent it and
+//   pin its paths, so that it grants no more than the client already has:
+//   the UID must be the client's own or allowed with -u, and the image and
+//   mount paths must resolve within the directories given with -i and -m,
+//   and the cgroup within the one given with -c. The image is opened here
+//   and handed on as /proc/self/fd/N, so it cannot be swapped for another
+//   file between the check and the mount.
+// Parameters:
+//   fs_fd - Receives the descriptor of the opened image, to be closed by the
+//           caller.
+//   fs_fd_path, mnt_path - Storage for the pinned paths 'req' points to.
+// Returns:
+//   0 if the request may be performed, -1 with errno set otherwise.
+static int authorize_request(int conn_fd, struct pexec_proto_request *req, int *fs_fd,
+                             char fs_fd_path[32], char mnt_path[PATH_MAX])
+{
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	char fs_path[PATH_MAX];
+
+	if(getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len))
+	{
+		debug("getsockopt(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	debug("Launch request from pid %d uid %d: \"%s\" as uid %d.",
+		cred.pid, cred.uid, req->opts.exec_path, req->opts.uid);
+
+	if(!uid_allowed(cred.uid, req->opts.uid))
+	{
+		debug("Refusing launch as uid %d for uid %d.", req->opts.uid, cred.uid);
+		errno = EPERM;
+		return -1;
+	}
+
+	if(realpath(req->opts.mnt_path, mnt_path) == NULL || !path_within(mount_dir, mnt_path))
+	{
+		debug("Refusing mount path \"%s\" outside \"%s\".", req->opts.mnt_path, mount_dir);
+		errno = EACCES;
+		return -1;
+	}
+
+	*fs_fd = open(req->opts.fs_path, O_RDONLY|O_CLOEXEC);
+
+	if(*fs_fd == -1)
+	{
+		debug("open(2) failed. (errno: %s)", clean_errno());
+		debug("open(\"%s\", O_RDONLY|O_CLOEXEC)", req->opts.fs_path);
+		return -1;
+	}
+
+	snprintf(fs_fd_path, 32, "/proc/self/fd/%d", *fs_fd);
+	ssize_t fs_path_size = readlink(fs_fd_path, fs_path, sizeof(fs_path) - 1);
+
+	if(fs_path_size == -1)
+	{
+		debug("readlink(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	fs_path[fs_path_size] = 0;
+
+	if(!path_within(image_dir, fs_path))
+	{
+		debug("Refusing image \"%s\" outside \"%s\".", fs_path, image_dir);
+		errno = EACCES;
+		return -1;
+	}
+
+	if(authorize_cgroup(req))
+	{
+		return -1;
+	}
+
+	req->opts.fs_path = fs_fd_path;
+	req->opts.mnt_path = mnt_path;
+
+	return 0;
+}
+
+// Description:
+//   Check that the cgroup of a request, passed as a descriptor or a path,
+//   lies within the directory given with -c. A path is opened here, and
+//   either way the request is pointed at /proc/self/fd/N of the checked
+//   descriptor, which pexec_proto_request_free() closes.
+// Returns:
+//   0 if the cgroup may be used, -1 with errno set otherwise.
+static int authorize_cgroup(struct pexec_proto_request *req)
+{
+	char cgroup_path[PATH_MAX];
+
+	if(req->cgroup_fd == -1)
+	{
+		if(req->opts.cgroup_path == NULL)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+
+		req->cgroup_fd = open(req->opts.cgroup_path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+
+		if(req->cgroup_fd == -1)
+		{
+			debug("open(2) failed. (errno: %s)", clean_errno());
+			debug("open(\"%s\", O_PATH|O_DIRECTORY|O_CLOEXEC)", req->opts.cgroup_path);
+			return -1;
+		}
+
+		snprintf(req->cgroup_fd_path, sizeof(req->cgroup_fd_path), "/proc/self/fd/%d", req->cgroup_fd);
+	}
+
+	ssize_t cgroup_path_size = readlink(req->cgroup_fd_path, cgroup_path, sizeof(cgroup_path) - 1);
+
+	if(cgroup_path_size == -1)
+	{
+		debug("readlink(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	cgroup_path[cgroup_path_size] = 0;
+
+	if(!path_within(cgroup_dir, cgroup_path))
+	{
+		debug("Refusing cgroup \"%s\" outside \"%s\".", cgroup_path, cgroup_dir);
+		errno = EPERM;
+		return -1;
+	}
+
+	req->opts.cgroup_path = req->cgroup_fd_path;
+
+	return 0;
+}
+
+// Returns:
+//   Whether a client running as 'peer_uid' may launch as 'uid'. Root may
+//   launch as anyone, since it could perform the launch itself.
+static bool uid_allowed(uid_t peer_uid, uid_t uid)
+{
+	if(peer_uid == 0 || uid == peer_uid)
+	{
+		return true;
+	}
+
+	for(int i = 0; i < allowed_uid_count; i++)
+	{
+		if(allowed_uids[i] == uid)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Returns:
+//   Whether the resolved 'path' is 'dir' itself or lies below it.
+static bool path_within(const char *dir, const char *path)
+{
+	size_t dir_len = strlen(dir);
+
+	if(strcmp(dir, "/") == 0)
+	{
+		return true;
+	}
+
+	return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '/' || path[dir_len] == 0);
+}
+
+// Description:
+//   Bind a SOCK_SEQPACKET socket at the given path. It is created with mode
+//   0600, or 0660 owned by 'gid' when one is given.
+// Returns:
+//   Listening socket on success, -1 on failure.
+static int listen_socket(const char *socket_path, gid_t gid)
+{
+	struct sockaddr_un addr;
+
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+
+	if(fd == -1)
+	{
+		debug("socket(2) failed. (errno: %s)", clean_errno());
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	// Remove a socket left behind by a previous instance
+	unlink(socket_path);
+
+	mode_t old_umask = umask(0177);
+	int bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(old_umask);
+
+	if(bound)
+	{
+		debug("bind(2) failed. (errno: %s)", clean_errno());
+		debug("bind(%d, \"%s\")", fd, socket_path);
+		goto error;
+	}
+
+	if(gid != (gid_t) -1 && (chown(socket_path, (uid_t) -1, gid) || chmod(socket_path, 0660)))
+	{
+		debug("Could not grant group %d access to \"%s\". (errno: %s)", gid, socket_path, clean_errno());
+		goto error;
+	}
+
+	if(listen(fd, SOMAXCONN))
+	{
+		debug("listen(2) failed. (errno: %s)", clean_errno());
+		goto error;
+	}
+
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static void on_shutdown_signal(int signum)
+{
+	(void) signum;
+	shutdown_requested = 1;
+}
+
+static void usage(void)
+{
+	puts("USAGE: pexecd -i IMAGE_DIR -m MOUNT_DIR -c CGROUP_DIR [-u UID]... [-s SOCKET_PATH] [-g GID]");
+}